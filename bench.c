@@ -0,0 +1,314 @@
+/*
+ * Copyright (c) 2014 Citrix Systems, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * input_bench: replay a captured evdev stream through the routing
+ * pipeline and report throughput and CPU cost per event.
+ *
+ * A capture is the raw struct input_event stream of a device, e.g.
+ *     cat /dev/input/event3 > touchpad.cap
+ * or, with -T, a text file of "type code value" lines, which does not depend
+ * on the struct layout of the machine it was taken on. Events are restamped
+ * as they are fed in, so the latency histograms cover the routing alone.
+ * Touchpad and tablet ranges are taken from the ABS values in the capture;
+ * -d reads them from the device node it came from instead, if it is still
+ * around.
+ *
+ * Events go to a single HVM domain. Only the routing code is linked in,
+ * everything around it is stubbed out in bench_stubs.c, so this runs
+ * anywhere, without a bus, xenstore or device models. The exit status is
+ * non-zero if nothing made it to the domain, which is what "make check"
+ * runs it for.
+ */
+
+#include "project.h"
+#include "bench.h"
+#include <getopt.h>
+#include <sys/resource.h>
+
+#define BENCH_DOMID     1
+#define BENCH_SLOT      0
+#define BENCH_READ_MAX  64
+
+static int bench_client;
+
+static const struct
+{
+    const char *name;
+    enum input_device_type type;
+} bench_types[] = {
+    { "keyboard", HID_TYPE_KEYBOARD },
+    { "mouse", HID_TYPE_MOUSE },
+    { "touchpad", HID_TYPE_TOUCHPAD },
+    { "tablet", HID_TYPE_TABLET },
+};
+
+static int bench_type(const char *name)
+{
+    unsigned int i;
+
+    for (i = 0; i < ARRAY_LEN(bench_types); i++)
+        if (!strcmp(bench_types[i].name, name))
+            return bench_types[i].type;
+    return -1;
+}
+
+static struct input_event *bench_load(const char *path, unsigned int *count)
+{
+    struct input_event *ev;
+    struct stat st;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st))
+    {
+        perror(path);
+        return NULL;
+    }
+
+    *count = st.st_size / sizeof(*ev);
+    ev = malloc(*count * sizeof(*ev));
+    if (!ev || read(fd, ev, *count * sizeof(*ev)) != (ssize_t) (*count * sizeof(*ev)))
+    {
+        fprintf(stderr, "%s: short read\n", path);
+        free(ev);
+        ev = NULL;
+    }
+    close(fd);
+    return ev;
+}
+
+/* One "type code value" event per line, '#' starts a comment. */
+static struct input_event *bench_load_text(const char *path, unsigned int *count)
+{
+    struct input_event *ev = NULL, *grown;
+    unsigned int size = 0, type, code;
+    char line[128];
+    int value;
+    FILE *f;
+
+    if (!(f = fopen(path, "r")))
+    {
+        perror(path);
+        return NULL;
+    }
+
+    *count = 0;
+    while (fgets(line, sizeof(line), f))
+    {
+        if (*line == '#' || sscanf(line, "%u %u %d", &type, &code, &value) != 3)
+            continue;
+
+        if (*count == size)
+        {
+            size = size ? size * 2 : 256;
+            if (!(grown = realloc(ev, size * sizeof(*ev))))
+            {
+                fprintf(stderr, "%s: out of memory\n", path);
+                free(ev);
+                ev = NULL;
+                break;
+            }
+            ev = grown;
+        }
+
+        memset(&ev[*count], 0, sizeof(*ev));
+        ev[*count].type = type;
+        ev[*count].code = code;
+        ev[*count].value = value;
+        (*count)++;
+    }
+    fclose(f);
+    return ev;
+}
+
+static void bench_range(struct input_absinfo *abs, int value, int *seen)
+{
+    if (!*seen || value < abs->minimum)
+        abs->minimum = value;
+    if (!*seen || value > abs->maximum)
+        abs->maximum = value;
+    *seen = 1;
+}
+
+/* What the device node would have told us, as far as the capture shows. */
+static void bench_ranges(const struct input_event *ev, unsigned int count, struct input_ranges *r)
+{
+    int seen_x = 0, seen_y = 0, seen_pressure = 0;
+    unsigned int i;
+
+    memset(r, 0, sizeof(*r));
+    r->clickpad = 1;
+
+    for (i = 0; i < count; i++)
+    {
+        if (ev[i].type == EV_ABS && ev[i].code == ABS_X)
+            bench_range(&r->x, ev[i].value, &seen_x);
+        else if (ev[i].type == EV_ABS && ev[i].code == ABS_Y)
+            bench_range(&r->y, ev[i].value, &seen_y);
+        else if (ev[i].type == EV_ABS && ev[i].code == ABS_PRESSURE)
+            bench_range(&r->pressure, ev[i].value, &seen_pressure);
+        else if (ev[i].type == EV_KEY && (ev[i].code == BTN_RIGHT || ev[i].code == BTN_MIDDLE))
+            r->clickpad = 0;
+    }
+}
+
+/* Move a chunk to the present, keeping the spacing within it, as if the
+ * kernel had just queued it. */
+static void bench_restamp(struct input_event *ev, unsigned int n)
+{
+    struct timeval now, delta;
+    unsigned int i;
+
+    gettimeofday(&now, NULL);
+    timersub(&now, &ev[n - 1].time, &delta);
+    for (i = 0; i < n; i++)
+        timeradd(&ev[i].time, &delta, &ev[i].time);
+}
+
+/* Feed the capture in the chunks a device read would have returned. */
+static unsigned long bench_replay(struct input_event *ev, unsigned int count)
+{
+    unsigned int start = 0, i;
+    unsigned long reads = 0;
+
+    for (i = 0; i < count; i++)
+    {
+        if ((ev[i].type != EV_SYN || ev[i].code != SYN_REPORT) &&
+            (i - start + 1 < BENCH_READ_MAX) && (i + 1 < count))
+            continue;
+
+        bench_restamp(&ev[start], i - start + 1);
+        input_process_events(BENCH_SLOT, &ev[start], i - start + 1);
+        event_loop(EVLOOP_NONBLOCK);
+        start = i + 1;
+        reads++;
+    }
+    return reads;
+}
+
+static double bench_cpu(void)
+{
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+        (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+static double bench_wall(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s -t keyboard|mouse|touchpad|tablet [-d devnode] [-n loops] [-b] [-T] capture\n", prog);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    struct input_event *ev;
+    struct input_ranges ranges;
+    struct domain *d;
+    unsigned int count, loop, loops = 1;
+    unsigned long reads = 0;
+    int type = -1, fd = -1, batch = 0, text = 0, c;
+    double wall, cpu;
+    char *latency;
+
+    while ((c = getopt(argc, argv, "t:d:n:bT")) != -1)
+    {
+        switch (c)
+        {
+        case 't':
+            type = bench_type(optarg);
+            break;
+        case 'd':
+            if ((fd = open(optarg, O_RDONLY)) < 0)
+            {
+                perror(optarg);
+                return 1;
+            }
+            break;
+        case 'n':
+            loops = strtoul(optarg, NULL, 10);
+            break;
+        case 'b':
+            batch = 1;
+            break;
+        case 'T':
+            text = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (type < 0 || optind != argc - 1 || !loops)
+        usage(argv[0]);
+
+    ev = text ? bench_load_text(argv[optind], &count) : bench_load(argv[optind], &count);
+    if (!ev || !count)
+        return 1;
+
+    bench_ranges(ev, count, &ranges);
+
+    event_init();
+    event_priority_init(EVENT_PRIORITIES);
+    if (input_replay_init() || input_replay_device(BENCH_SLOT, fd, type, &ranges))
+    {
+        fprintf(stderr, "Failed to set up the replay device\n");
+        return 1;
+    }
+
+    if (!(d = domain_new(BENCH_DOMID)))
+        return 1;
+    d->client = (dmbus_client_t) &bench_client;
+    d->initialised = true;
+#ifdef HAVE_DMBUS_INPUT_EVENT_BATCH
+    if (batch)
+        d->input_caps |= INPUT_CAP_EVENT_BATCH;
+#endif
+    input_set(d);
+
+    wall = bench_wall();
+    cpu = bench_cpu();
+    for (loop = 0; loop < loops; loop++)
+        reads += bench_replay(ev, count);
+    wall = bench_wall() - wall;
+    cpu = bench_cpu() - cpu;
+
+    printf("%lu events in %lu reads, %.3fs wall, %.3fs cpu\n",
+           (unsigned long) count * loops, reads, wall, cpu);
+    printf("%.0f events/s, %.0f ns cpu/event\n",
+           count * loops / wall, cpu * 1e9 / ((double) count * loops));
+    printf("%lu events sent to dom%d in %lu dmbus messages\n",
+           bench_sent, BENCH_DOMID, bench_msgs);
+
+    latency = latency_format();
+    printf("latency per type and destination, buckets <64us doubling:\n%s", latency);
+    g_free(latency);
+
+    if (fd >= 0)
+        close(fd);
+    free(ev);
+    return !bench_sent;
+}
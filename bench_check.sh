@@ -0,0 +1,26 @@
+#!/bin/sh
+#
+# Copyright (c) 2014 Citrix Systems, Inc.
+# 
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2.1 of the License, or (at your option) any later version.
+# 
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+# 
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+#
+
+# Replay the captures in the tree through input_bench. It fails if nothing
+# reaches the domain; the numbers are printed for comparison between builds.
+
+srcdir=${srcdir:-.}
+
+./input_bench -T -t mouse -n 100 "$srcdir/bench_mouse.txt" || exit 1
+./input_bench -T -t touchpad -n 100 "$srcdir/bench_touchpad.txt" || exit 1
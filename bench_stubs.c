@@ -0,0 +1,271 @@
+/*
+ * Copyright (c) 2014 Citrix Systems, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * Stand-ins for everything input_bench does not link: the dmbus client,
+ * the db and xenstore, the xen backend, the domain table, the switcher and
+ * the dbus side of the daemon. The routing code in input.c, touchpad.c,
+ * usb-tablet.c, gesture.c and socket.c runs unchanged on top of them, with
+ * the real util.c and latency.c.
+ */
+
+#include "project.h"
+#include "bench.h"
+
+unsigned long bench_msgs;
+unsigned long bench_sent;
+
+/* dmbus: count what would have gone to the device model. */
+int dom0_input_event(dmbus_client_t client, struct msg_dom0_input_event *msg, size_t len)
+{
+    bench_msgs++;
+    bench_sent++;
+    return 0;
+}
+
+#ifdef HAVE_DMBUS_INPUT_EVENT_BATCH
+int dom0_input_event_batch(dmbus_client_t client, struct msg_dom0_input_event_batch *msg, size_t len)
+{
+    bench_msgs++;
+    bench_sent += msg->count;
+    return 0;
+}
+#endif
+
+#ifdef HAVE_DMBUS_INPUT_EVENT_TS
+int dom0_input_event_ts_batch(dmbus_client_t client, struct msg_dom0_input_event_ts_batch *msg, size_t len)
+{
+    bench_msgs++;
+    bench_sent += msg->count;
+    return 0;
+}
+#endif
+
+int input_config(dmbus_client_t client, struct msg_input_config *msg, size_t len)
+{
+    return 0;
+}
+
+int input_config_reset(dmbus_client_t client, struct msg_input_config_reset *msg, size_t len)
+{
+    return 0;
+}
+
+/* db and xenstore: nothing is configured, so every setting is its default. */
+int db_read(char *buf, int buf_size, const char *path)
+{
+    if (buf_size > 0)
+        *buf = 0;
+    return FALSE;
+}
+
+int db_read_async(const char *path, db_read_cb_t cb, void *opaque)
+{
+    return FALSE;
+}
+
+int db_write(const char *path, const char *value)
+{
+    return FALSE;
+}
+
+char *xenstore_dom_read(int domid, const char *fmt, ...)
+{
+    return NULL;
+}
+
+/* xen backend: the bench domain is an HVM, it never has a vkbd. */
+void xen_vkbd_send_event(struct domain *d, struct input_event *event, int type)
+{
+}
+
+void xen_event_flush(struct xen_vkbd_backend *backend)
+{
+}
+
+_Bool xen_event_busy(struct xen_vkbd_backend *backend)
+{
+    return 0;
+}
+
+/* domains: a single one, created by domain_new(). */
+static struct domain bench_domain;
+static bool bench_domain_used;
+static struct domain *keyb_dest;
+
+struct domain *domain_new(int domid)
+{
+    struct domain *d = &bench_domain;
+
+    if (bench_domain_used)
+        return NULL;
+    bench_domain_used = true;
+
+    memset(d, 0, sizeof (*d));
+    d->domid = domid;
+    d->slot = -1;
+    d->mouse_switch.left = -1;
+    d->mouse_switch.right = -1;
+    d->last_devslot = INPUTSLOT_INVALID;
+    d->rel_x_mult = MAX_MOUSE_ABS_X / DEFAULT_RESOLUTION_X;
+    d->rel_y_mult = MAX_MOUSE_ABS_Y / DEFAULT_RESOLUTION_Y;
+    d->sstate = 5;
+    d->prev_keyb_domid = -1;
+    return d;
+}
+
+struct domain *domain_with_domid(int domid)
+{
+    if (bench_domain_used && bench_domain.domid == domid)
+        return &bench_domain;
+    return NULL;
+}
+
+void iterate_domains(void (*callback)(struct domain *, void *), void *opaque)
+{
+    if (bench_domain_used)
+        callback(&bench_domain, opaque);
+}
+
+struct domain *domain_uivm(void)
+{
+    return NULL;
+}
+
+struct domain *domain_pvm(void)
+{
+    return NULL;
+}
+
+int domain_cant_print_screen(struct domain *d)
+{
+    return 0;
+}
+
+void domain_wake_from_s3(struct domain *d)
+{
+}
+
+int add_domainstart_callback(void (*callback)(struct domain *))
+{
+    return 0;
+}
+
+void set_keyb_dest(struct domain *d)
+{
+    if (keyb_dest != d)
+    {
+        keyb_dest = d;
+        input_set_focus_change();
+    }
+}
+
+struct domain *get_keyb_dest(void)
+{
+    return keyb_dest;
+}
+
+/* switcher: focus stays where input_set() put it. */
+int32_t switcher_get_focus(void)
+{
+    return keyb_dest ? keyb_dest->domid : -1;
+}
+
+int switcher_lock(int can_switch_out)
+{
+    return 0;
+}
+
+int switcher_resistance(void)
+{
+    return 0;
+}
+
+int switcher_switch(struct domain *d, int mouse_switch, int force)
+{
+    return 0;
+}
+
+void switcher_switch_left(void)
+{
+}
+
+void switcher_switch_right(void)
+{
+}
+
+void switcher_switch_on_mouse(struct input_event *e, int x, int y)
+{
+}
+
+/* dbus side of the daemon: there is no bus to talk to. */
+gboolean notify_com_citrix_xenclient_input_keyboard_focus_change(xcdbus_conn_t *conn, const char *service,
+                                                                 const char *obj_path, const char *uuid)
+{
+    return TRUE;
+}
+
+gboolean notify_com_citrix_xenclient_input_focus_auth_field(xcdbus_conn_t *conn, const char *service,
+                                                            const char *obj_path, gint field)
+{
+    return TRUE;
+}
+
+gboolean notify_com_citrix_xenclient_input_sync_auth_username(xcdbus_conn_t *conn, const char *service,
+                                                              const char *obj_path, const char *username)
+{
+    return TRUE;
+}
+
+void emit_secure_mode(int32_t onoff)
+{
+}
+
+struct auth_context_t *auth_get_context(void)
+{
+    return NULL;
+}
+
+int auth_begin(void)
+{
+    return 0;
+}
+
+void auth_end(const char *user, const char *password, const char *password_confirm, const char *password_old)
+{
+}
+
+void auth_status(const char *status, int is_error, int hide_window, int32_t flags)
+{
+}
+
+int user_get_name(const char *hash, char *name)
+{
+    return 0;
+}
+
+/* The rest of what the routing code leans on. */
+int keycode2ascii(int keycode)
+{
+    return 0;
+}
+
+void lid_create_switch_event(int fd)
+{
+}
+
@@ -269,6 +269,14 @@ input_daemon_get_focus_domid (InputDaemonObject *this, gint* OUT_domid, GError**
     return TRUE;
 }
 
+/* The switch is asynchronous, success only means it was started. */
+static void
+switch_focus_done(int domid, int ok, void *opaque)
+{
+    if (!ok)
+        warning("Cannot switch to dom%u, surfman did not make it visible.", domid);
+}
+
 gboolean
 input_daemon_switch_focus (InputDaemonObject *this, gint IN_domid, gboolean IN_force, gboolean *OUT_success, GError** err)
 {
@@ -285,7 +293,7 @@ input_daemon_switch_focus (InputDaemonObject *this, gint IN_domid, gboolean IN_f
         warning("Cannot switch to dom%u, this domid is not registered.", IN_domid);
         goto out;
     }
-    if (switcher_switch(dom, 0, IN_force) < 0) {
+    if (switcher_switch_cb(dom, 0, IN_force, switch_focus_done, NULL) < 0) {
         warning("Cannot switch to dom%u, switcher_switch() failed...", IN_domid);
         goto out;
     }
@@ -524,6 +532,34 @@ input_daemon_get_last_input_time (InputDaemonObject *this, gint* OUT_lastInputTi
     return TRUE;
 }
 
+/* xenmgr tells the world when a VM's configuration changes. Refresh the
+ * cached seamless-mouse layout of that VM and the /switcher and /mouse
+ * settings, so the input path never has to ask. All of it is asked for
+ * asynchronously and applied as the answers come in, the filter runs on
+ * the event loop. */
+static DBusHandlerResult
+bus_config_changed_filter(DBusConnection *conn, DBusMessage *msg, void *opaque)
+{
+    const char *uuid = NULL;
+    const char *path = NULL;
+    struct domain *d;
+
+    if (!dbus_message_is_signal(msg, XENMGR_INTERFACE, "vm_config_changed"))
+        return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+    if (dbus_message_get_args(msg, NULL,
+                              DBUS_TYPE_STRING, &uuid,
+                              DBUS_TYPE_OBJECT_PATH, &path,
+                              DBUS_TYPE_INVALID) &&
+        (d = domain_with_uuid(uuid)))
+        domain_mouse_switch_config_async(d);
+
+    switcher_settings_refresh();
+    input_settings_refresh();
+
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
 void bus_init()
 {
     InputDaemonObject *server_obj = NULL;
@@ -554,6 +590,10 @@ void bus_init()
     info("waiting for com.citrix.xenclient.db service..");
     xcdbus_wait_service(xcbus_conn, "com.citrix.xenclient.db");
     info("connected");
+
+    dbus_bus_add_match(bus_conn, "type='signal',interface='" XENMGR_INTERFACE "',"
+                       "member='vm_config_changed'", NULL);
+    dbus_connection_add_filter(bus_conn, bus_config_changed_filter, NULL, NULL);
 }
 
 void emit_secure_mode(int32_t onoff)
@@ -621,6 +661,50 @@ int db_write(const char *path, const char *value)
     return com_citrix_xenclient_db_write_ ( xcbus_conn, DB_SERVICE, DB_PATH, path, value );
 }
 
+struct db_read_req
+{
+    db_read_cb_t cb;
+    void *opaque;
+};
+
+static void db_read_done(DBusGProxy *proxy, DBusGProxyCall *call, void *opaque)
+{
+    struct db_read_req *req = opaque;
+    char *value = NULL;
+
+    if (!dbus_g_proxy_end_call(proxy, call, NULL, G_TYPE_STRING, &value, G_TYPE_INVALID))
+        return;
+    req->cb(value, req->opaque);
+    g_free(value);
+}
+
+/* Same as db_read(), for callers on the event loop that must not wait for
+ * dbd. cb runs when the value arrives, and not at all if the read fails. */
+int db_read_async(const char *path, db_read_cb_t cb, void *opaque)
+{
+    static DBusGProxy *proxy = NULL;
+    struct db_read_req *req;
+
+    if (!proxy)
+        proxy = xcdbus_get_proxy(xcbus_conn, DB_SERVICE, DB_PATH, DB_INTERFACE);
+    if (!proxy)
+        return FALSE;
+
+    req = malloc(sizeof (*req));
+    if (!req)
+        return FALSE;
+    req->cb = cb;
+    req->opaque = opaque;
+
+    if (!dbus_g_proxy_begin_call(proxy, "read", db_read_done, req, free,
+                                 G_TYPE_STRING, path, G_TYPE_INVALID))
+    {
+        free(req);
+        return FALSE;
+    }
+    return TRUE;
+}
+
 
 #define MAX_MODS 20
 int Modifers[MAX_MODS];
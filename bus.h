@@ -24,11 +24,16 @@
 #define SURFMAN_PATH    "/"
 
 #define XENMGR_SERVICE      "com.citrix.xenclient.xenmgr"
+#define XENMGR_INTERFACE    "com.citrix.xenclient.xenmgr"
 #define XENMGR_VMS_OBJPATH  "/com/citrix/xenclient/xenmgr/vms"
 #define XENMGR_HOST_OBJPATH "/host"
 
-#define DB_SERVICE "com.citrix.xenclient.db"
-#define DB_PATH    "/"
+#define DB_SERVICE   "com.citrix.xenclient.db"
+#define DB_PATH      "/"
+#define DB_INTERFACE "com.citrix.xenclient.db"
+
+/* Called with the value of a key once db_read_async() gets it from dbd */
+typedef void (*db_read_cb_t)(const char *value, void *opaque);
 
 #define XCPMD_SERVICE "com.citrix.xenclient.xcpmd"
 #define XCPMD_PATH    "/"
@@ -22,11 +22,71 @@
 
 extern struct timeval global_last_input_event;
 
-static struct domain domains[NDOMAIN_MAX];
+/* Domains are allocated one by one so pointers to them stay valid while the
+ * table grows. */
+static struct domain **domains = NULL;
+static unsigned int ndomains = 0;
+
+/* Direct-mapped lookup indexes. An entry is only trusted if the domain it
+ * points to still matches the key, a miss falls back to a scan and refills
+ * the entry. */
+#define DOMAIN_INDEX_SIZE 64
+
+static struct domain *domid_index[DOMAIN_INDEX_SIZE];
+static struct domain *slot_index[DOMAIN_INDEX_SIZE];
+static struct domain *uuid_index[DOMAIN_INDEX_SIZE];
+static struct domain *pvm_index;
 
 static xc_interface *xc_handle = NULL;
 static bool destroy_in_fork = false;
 
+static unsigned int domain_index_of(int key)
+{
+    return (unsigned int) key % DOMAIN_INDEX_SIZE;
+}
+
+static unsigned int domain_index_of_uuid(const char *uuid)
+{
+    unsigned int h = 5381;
+
+    while (*uuid)
+        h = h * 33 + (unsigned char) *uuid++;
+
+    return h % DOMAIN_INDEX_SIZE;
+}
+
+/* Record the domain under its current domid, slot and uuid. */
+static void domain_index(struct domain *d)
+{
+    if (!d->initialised)
+        return;
+
+    if (d->domid >= 0)
+        domid_index[domain_index_of(d->domid)] = d;
+    if (d->slot >= 0)
+        slot_index[domain_index_of(d->slot)] = d;
+    if (d->uuid)
+        uuid_index[domain_index_of_uuid(d->uuid)] = d;
+    if (d->is_pvm)
+        pvm_index = d;
+}
+
+static void domain_unindex(struct domain *d)
+{
+    unsigned int i;
+
+    for (i = 0; i < DOMAIN_INDEX_SIZE; ++i) {
+        if (domid_index[i] == d)
+            domid_index[i] = NULL;
+        if (slot_index[i] == d)
+            slot_index[i] = NULL;
+        if (uuid_index[i] == d)
+            uuid_index[i] = NULL;
+    }
+    if (pvm_index == d)
+        pvm_index = NULL;
+}
+
 void domain_print(const struct domain *d)
 {
     if (!d->initialised)
@@ -36,7 +96,8 @@ void domain_print(const struct domain *d)
             "%sconnected dmbus-client, "
             "is %sPV, is %spvm, is %sin s3, "
             "ABS %sable, "
-            "desktop:%dx%d & relative:%dx%d, %d active adapters.",
+            "desktop:%dx%d & relative:%dx%d, %d active adapters, "
+            "%u events/s in %u msgs/s.",
             d->domid, d->slot,
             d->client ? "" : "dis",
             d->is_pv_domain ? "" : "not ",
@@ -45,43 +106,54 @@ void domain_print(const struct domain *d)
             d->abs_enabled ? "en" : "dis",
             d->desktop_xres, d->desktop_yres,
             d->rel_x_mult, d->rel_y_mult,
-            d->num_active_adapters);
+            d->num_active_adapters,
+            d->rate.events_per_sec, d->rate.msgs_per_sec);
+
+    if (d->initialised && d->vkbd_backend)
+    {
+        unsigned long merged, dropped;
+
+        xen_event_stats(d->vkbd_backend, &merged, &dropped);
+        info("dom%u vkbd ring: %lu events merged, %lu dropped.",
+             d->domid, merged, dropped);
+    }
 }
 
 void domains_print(void)
 {
-    int i;
+    unsigned int i;
 
-    for (i = 0; i < NDOMAIN_MAX; ++i)
-        domain_print(&domains[i]);
+    for (i = 0; i < ndomains; ++i)
+        domain_print(domains[i]);
 }
 
 void iterate_domains(void (*callback)(struct domain *,void*), void* opaque)
 {
-    int i;
-    for (i = 0; i < NDOMAIN_MAX; i++)
+    unsigned int i;
+    for (i = 0; i < ndomains; i++)
     {
-        if (domains[i].initialised)
-            callback(&domains[i], opaque);
+        if (domains[i]->initialised)
+            callback(domains[i], opaque);
     }
 }
 
 void check_diverts_for_the_dead(struct domain* d)
 {
-    int i;
-    for (i = 0; i < NDOMAIN_MAX; ++i)
+    unsigned int i;
+    for (i = 0; i < ndomains; ++i)
     {
-        if (domains[i].divert_info != NULL)
-            divert_domain_gone(domains[i].divert_info, d);
+        if (domains[i]->divert_info != NULL)
+            divert_domain_gone(domains[i]->divert_info, d);
     }
 }
 
 int domains_count(void)
 {
-    int         i, n = 0;
+    unsigned int i;
+    int          n = 0;
 
-    for (i = 0; i < NDOMAIN_MAX; i++)
-        if (domains[i].initialised)
+    for (i = 0; i < ndomains; i++)
+        if (domains[i]->initialised)
             n++;
     return n;
 }
@@ -90,38 +162,75 @@ void
 domain_set_slot(struct domain *d, int slot)
 {
     d->slot = slot;
+    domain_index(d);
     xenstore_dom_write_int(d->domid, d->slot, "switcher/slot");
 }
 
 static struct domain *empty_domain()
 {
-    int i;
+    struct domain **table;
+    struct domain *d;
+    unsigned int i;
 
-    for (i = 0; i < NDOMAIN_MAX; ++i)
-        if (!domains[i].initialised)
-            return &domains[i];
+    for (i = 0; i < ndomains; ++i)
+        if (!domains[i]->initialised)
+            return domains[i];
 
-    return NULL;
+    d = calloc(1, sizeof (*d));
+    if (!d)
+        return NULL;
+
+    table = realloc(domains, (ndomains + 1) * sizeof (*domains));
+    if (!table) {
+        free(d);
+        return NULL;
+    }
+    domains = table;
+    domains[ndomains++] = d;
+
+    return d;
 }
 
 struct domain *domain_with_domid(int domid)
 {
-    int i;
-    for (i = 0; i < NDOMAIN_MAX; ++i) {
-        if (domains[i].initialised &&
-            domains[i].domid == domid)
-            return &domains[i];
+    struct domain *d;
+    unsigned int i;
+
+    if (domid < 0)
+        return NULL;
+
+    d = domid_index[domain_index_of(domid)];
+    if (d && d->initialised && d->domid == domid)
+        return d;
+
+    for (i = 0; i < ndomains; ++i) {
+        if (domains[i]->initialised &&
+            domains[i]->domid == domid) {
+            domain_index(domains[i]);
+            return domains[i];
+        }
     }
     return NULL;
 }
 
 struct domain * domain_with_slot(int slot)
 {
-    int i;
-    for (i = 0; i < NDOMAIN_MAX; ++i) {
-        if (domains[i].initialised &&
-            domains[i].slot == slot)
-            return &domains[i];
+    struct domain *d;
+    unsigned int i;
+
+    if (slot < 0)
+        return NULL;
+
+    d = slot_index[domain_index_of(slot)];
+    if (d && d->initialised && d->slot == slot)
+        return d;
+
+    for (i = 0; i < ndomains; ++i) {
+        if (domains[i]->initialised &&
+            domains[i]->slot == slot) {
+            domain_index(domains[i]);
+            return domains[i];
+        }
     }
     return NULL;
 }
@@ -129,24 +238,32 @@ struct domain * domain_with_slot(int slot)
 
 struct domain * domain_with_slot_and_not_domid(int slot, int domid)
 {
-    int i;
-    for (i = 0; i < NDOMAIN_MAX; ++i) {
-        if (domains[i].initialised &&
-            domains[i].slot == slot &&
-            domains[i].domid != domid)
-            return &domains[i];
+    unsigned int i;
+    for (i = 0; i < ndomains; ++i) {
+        if (domains[i]->initialised &&
+            domains[i]->slot == slot &&
+            domains[i]->domid != domid)
+            return domains[i];
     }
     return NULL;
 }
 
 struct domain *domain_with_uuid(const char *uuid)
 {
-    int i;
-    for (i = 0; i < NDOMAIN_MAX; ++i) {
-        if (domains[i].initialised &&
-            domains[i].uuid &&
-            !strcmp(domains[i].uuid, uuid))
-            return &domains[i];
+    struct domain *d;
+    unsigned int i;
+
+    d = uuid_index[domain_index_of_uuid(uuid)];
+    if (d && d->initialised && d->uuid && !strcmp(d->uuid, uuid))
+        return d;
+
+    for (i = 0; i < ndomains; ++i) {
+        if (domains[i]->initialised &&
+            domains[i]->uuid &&
+            !strcmp(domains[i]->uuid, uuid)) {
+            domain_index(domains[i]);
+            return domains[i];
+        }
     }
     return NULL;
 }
@@ -159,11 +276,17 @@ struct domain * domain_uivm(void)
 
 struct domain * domain_pvm(void)
 {
-    int i;
-    for (i = 0; i < NDOMAIN_MAX; ++i) {
-        if (domains[i].initialised &&
-            domains[i].is_pvm)
-            return &domains[i];
+    unsigned int i;
+
+    if (pvm_index && pvm_index->initialised && pvm_index->is_pvm)
+        return pvm_index;
+
+    for (i = 0; i < ndomains; ++i) {
+        if (domains[i]->initialised &&
+            domains[i]->is_pvm) {
+            pvm_index = domains[i];
+            return domains[i];
+        }
     }
     return NULL;
 }
@@ -171,18 +294,18 @@ struct domain * domain_pvm(void)
 
 static void reset_prev_keyb_domain(struct domain *d)
 {
-    int i = 0;
+    unsigned int i = 0;
 
     if ((d == NULL) || (d->domid == -1))
         return;
 
-    for (i = 0; i < NDOMAIN_MAX; i++)
+    for (i = 0; i < ndomains; i++)
     {
-        if (domains[i].initialised && (domains[i].prev_keyb_domid == d->domid))
+        if (domains[i]->initialised && (domains[i]->prev_keyb_domid == d->domid))
         {
-            info("reset previous keyboard domain for domain %d\n", domains[i].domid);
-            domains[i].prev_keyb_domain_ptr = NULL;
-            domains[i].prev_keyb_domid = -1;
+            info("reset previous keyboard domain for domain %d\n", domains[i]->domid);
+            domains[i]->prev_keyb_domain_ptr = NULL;
+            domains[i]->prev_keyb_domid = -1;
         }
     }
 }
@@ -417,6 +540,7 @@ void domain_gone(struct domain *d)
     if (!destroy_in_fork)
         reset_prev_keyb_domain(d);
 
+    domain_unindex(d);
     free(d->uuid);
     destroy_divert_info(&d->divert_info);
     d->client = NULL;
@@ -497,7 +621,7 @@ static void domain_power_state(const char *path, void *opaque)
     {
         info("domain id=%d entered s3",d->domid);
         d->is_in_s3 = 1;
-        gettimeofday(&d->time_of_s3, NULL);
+        monotonic_time(&d->time_of_s3);
 
         /* If a domain goes to sleep, then reset its previous keyboard domain
            so that on wakeup, the domain itself will have the keyboard. */
@@ -518,25 +642,26 @@ static void domain_power_state(const char *path, void *opaque)
 int get_idle_time()
 {
     struct timeval now;
-    int i, latest_input_activity=0, sleeping_vm_count=0, guest_vm_count=0, uivm_domid = -1;
+    unsigned int i;
+    int latest_input_activity=0, sleeping_vm_count=0, guest_vm_count=0, uivm_domid = -1;
     struct domain *uivm = domain_uivm();
 
     if (uivm != NULL)
         uivm_domid = uivm->domid;
 
     /* Calculate latest_input_activity considering all domains except uivm */
-    for (i = 0; i < NDOMAIN_MAX; i++)
+    for (i = 0; i < ndomains; i++)
     {
-            if (domains[i].initialised && (domains[i].domid != uivm_domid))
+            if (domains[i]->initialised && (domains[i]->domid != uivm_domid))
             {
                     guest_vm_count++;
-                    if(domains[i].is_in_s3)
+                    if(domains[i]->is_in_s3)
                     {
-                        domains[i].last_input_event = domains[i].time_of_s3;
+                        domains[i]->last_input_event = domains[i]->time_of_s3;
                         sleeping_vm_count++;
                     }
 
-                    latest_input_activity = MAX(latest_input_activity,domains[i].last_input_event.tv_sec);
+                    latest_input_activity = MAX(latest_input_activity,domains[i]->last_input_event.tv_sec);
             }
     }
 
@@ -546,7 +671,7 @@ int get_idle_time()
        /* Dont crash if there is no uivm running. */
         if (uivm != NULL)
             latest_input_activity = MAX(latest_input_activity,uivm->last_input_event.tv_sec);
-        gettimeofday(&now,NULL);
+        monotonic_time(&now);
         return (now.tv_sec - latest_input_activity);
     }
     else
@@ -557,7 +682,7 @@ int get_last_input_time()
 {
     struct timeval now;
 
-    gettimeofday(&now,NULL);
+    monotonic_time(&now);
     return (now.tv_sec - global_last_input_event.tv_sec);
 }
 
@@ -674,6 +799,7 @@ domain_read_uuid(struct domain *d)
         return;
     d->uuid = xenstore_read("%s/uuid", tmp);
     free(tmp);
+    domain_index(d);
 }
 
 static void
@@ -726,6 +852,19 @@ domain_read_has_secondary_gpu(struct domain *d)
     d->has_secondary_gpu = (gpu != 0);
 }
 
+static void
+domain_read_coalesce_motion(struct domain *d)
+{
+    char tmp[16];
+    char path[128];
+
+    sprintf(path, "/vm/%s/coalesce-motion", d->uuid);
+    d->coalesce.enabled = db_read(tmp, sizeof (tmp), path) && strcmp(tmp, "true") == 0;
+
+    if (d->coalesce.enabled)
+        info("coalescing pointer motion for domid:%d while it is busy", d->domid);
+}
+
 static int
 domain_read_slot(struct domain *d)
 {
@@ -918,6 +1057,7 @@ static void switcher_domid(struct domain *d, uint32_t domid)
       return;
   }
   d->slot = slot;
+  domain_index(d);
 
   info("New domain %d (slot %d)", domid, slot);
 
@@ -964,6 +1104,7 @@ static void switcher_domid(struct domain *d, uint32_t domid)
 
   xen_vkbd_backend_create(d);
   domain_read_has_secondary_gpu(d);
+  domain_read_coalesce_motion(d);
 
   domain_mouse_switch_config(d);
 
@@ -989,12 +1130,23 @@ void handle_switcher_abs(void *priv, struct msg_switcher_abs *msg, size_t msglen
   info("PV mouse driver reports abs support is %s for domid:%d", (d->abs_enabled)?"on":"off",d->domid);
 }
 
+#ifdef HAVE_DMBUS_INPUT_EVENT_BATCH
+void handle_input_caps(void *priv, struct msg_input_caps *msg, size_t msglen)
+{
+  struct domain *d = priv;
+
+  d->input_caps = msg->caps & INPUT_CAPS_SUPPORTED;
+  info("device model reports input caps 0x%x for domid:%d", d->input_caps, d->domid);
+}
+#endif
+
 void switcher_pvm_domid(struct domain *d, uint32_t domid)
 {
   switcher_domid(d, domid);
 
   info("Domain %d is a pvm", d->domid);
   d->is_pvm = 1;
+  domain_index(d);
   xenstore_dom_write_int(d->domid, 1, "switcher/have_gpu");
 
   focus_update_domain(d);
@@ -1132,6 +1284,113 @@ void domain_mouse_switch_config(void *opaque)
     d->mouse_switch.right = values[1];
 }
 
+/*
+** Same as domain_mouse_switch_config(), for callers that must not block
+** on xenmgr: the vm lookup and the two property reads are chained
+** asynchronously and the result applied when the last one returns.
+*/
+static const char *mouse_switch_props[] = { "seamless-mouse-left", "seamless-mouse-right" };
+
+struct mouse_switch_req
+{
+    char *uuid;
+    /* Borrowed: xcdbus_get_proxy() hands out the proxy it keeps per
+     * service, path and interface, which is why the generated client calls
+     * can look it up on every call without releasing it. */
+    DBusGProxy *vm_proxy;
+    unsigned int n;
+    int values[2];
+};
+
+static void mouse_switch_req_free(struct mouse_switch_req *req)
+{
+    free(req->uuid);
+    free(req);
+}
+
+static int mouse_switch_get(struct mouse_switch_req *req);
+
+static void mouse_switch_get_done(DBusGProxy *proxy, DBusGProxyCall *call, void *opaque)
+{
+    struct mouse_switch_req *req = opaque;
+    GValue value = G_VALUE_INIT;
+    struct domain *d;
+
+    if (!dbus_g_proxy_end_call(proxy, call, NULL, G_TYPE_VALUE, &value, G_TYPE_INVALID))
+    {
+        mouse_switch_req_free(req);
+        return;
+    }
+
+    if (G_VALUE_HOLDS(&value, G_TYPE_INT))
+        req->values[req->n] = g_value_get_int(&value);
+    g_value_unset(&value);
+
+    if (++req->n < ARRAY_LEN(mouse_switch_props) && mouse_switch_get(req))
+        return;
+
+    /* The domain may have gone while xenmgr was answering. */
+    if (req->n == ARRAY_LEN(mouse_switch_props) && (d = domain_with_uuid(req->uuid)))
+    {
+        info ("configuring seamless mouse for uuid=%s left=%d right=%d",
+              d->uuid, req->values[0], req->values[1]);
+        d->mouse_switch.left = req->values[0];
+        d->mouse_switch.right = req->values[1];
+    }
+    mouse_switch_req_free(req);
+}
+
+static int mouse_switch_get(struct mouse_switch_req *req)
+{
+    return dbus_g_proxy_begin_call(req->vm_proxy, "Get", mouse_switch_get_done, req, NULL,
+                                   G_TYPE_STRING, "com.citrix.xenclient.xenmgr.vm",
+                                   G_TYPE_STRING, mouse_switch_props[req->n],
+                                   G_TYPE_INVALID) != NULL;
+}
+
+static void mouse_switch_find_done(DBusGProxy *proxy, DBusGProxyCall *call, void *opaque)
+{
+    struct mouse_switch_req *req = opaque;
+    char *obj_path = NULL;
+
+    if (dbus_g_proxy_end_call(proxy, call, NULL,
+                              DBUS_TYPE_G_OBJECT_PATH, &obj_path, G_TYPE_INVALID))
+    {
+        req->vm_proxy = xcdbus_get_proxy(xcbus_conn, "com.citrix.xenclient.xenmgr", obj_path,
+                                         "org.freedesktop.DBus.Properties");
+        g_free(obj_path);
+        if (req->vm_proxy && mouse_switch_get(req))
+            return;
+    }
+    mouse_switch_req_free(req);
+}
+
+void domain_mouse_switch_config_async(struct domain *d)
+{
+    static DBusGProxy *xenmgr = NULL;
+    struct mouse_switch_req *req;
+
+    if (!xenmgr)
+        xenmgr = xcdbus_get_proxy(xcbus_conn, "com.citrix.xenclient.xenmgr", "/",
+                                  "com.citrix.xenclient.xenmgr");
+    if (!xenmgr || !d->uuid)
+        return;
+
+    req = calloc(1, sizeof (*req));
+    if (!req)
+        return;
+    if (!(req->uuid = strdup(d->uuid)))
+    {
+        free(req);
+        return;
+    }
+    req->values[0] = req->values[1] = -1;
+
+    if (!dbus_g_proxy_begin_call(xenmgr, "find_vm_by_uuid", mouse_switch_find_done, req, NULL,
+                                 G_TYPE_STRING, d->uuid, G_TYPE_INVALID))
+        mouse_switch_req_free(req);
+}
+
 
 struct domain *domain_create(dmbus_client_t client, int domid, DeviceType type)
 {
@@ -1209,6 +1468,7 @@ void domain_release(struct domain *d)
 
     /* TODO: These have deep entanglement with the behaviour of input. */
     reset_prev_keyb_domain(d);
+    domain_unindex(d);
     free(d->uuid);
     destroy_divert_info(&d->divert_info);
 
@@ -1234,7 +1494,7 @@ int domain_assign_slot(struct domain *d)
 
     /* Slot is set by the toolstack in Xenstore. */
     slot = domain_read_slot(d);
-    if (slot < 0 || slot >= NDOMAIN_MAX) {
+    if (slot < 0) {
         error("%s: Slot %d is invalid.", __func__, slot);
         return -EINVAL;
     }
@@ -1320,6 +1580,7 @@ int domain_setup(struct domain *d)
     domain_mouse_switch_config(d);
 
     d->initialised = true;
+    domain_index(d);
     return 0;
 }
 
@@ -1327,6 +1588,7 @@ int domain_set_pvm(struct domain *d, bool is_pvm)
 {
     assert(d != NULL);
     d->is_pvm = is_pvm;
+    domain_index(d);
     xenstore_dom_write_int(d->domid, d->is_pvm, "switcher/have_gpu");
     return 0;
 }
@@ -1373,19 +1635,13 @@ void domain_detach_vkbd(struct domain *d)
 
 void domains_init(void)
 {
-    int i;
-
     if (xc_handle == NULL)
         xc_handle = xc_interface_open(NULL, NULL, 0);
 
-    for (i = 0; i < NDOMAIN_MAX; i++)
-    {
-        memset( &domains[i], 0, sizeof(struct domain) );
-        domains[i].domid=-1;
-        domains[i].slot=-1;
-        domains[i].client=NULL;
-        domains[i].initialised=false;
-    }
+    memset(domid_index, 0, sizeof (domid_index));
+    memset(slot_index, 0, sizeof (slot_index));
+    memset(uuid_index, 0, sizeof (uuid_index));
+    pvm_index = NULL;
 }
 
 
@@ -1395,10 +1651,10 @@ void domains_release(bool infork)
 
     destroy_in_fork = infork;
 
-    for (i = 0; i < NDOMAIN_MAX; i++)
+    for (i = 0; i < ndomains; i++)
     {
-        if (domains[i].client)
-            dmbus_client_disconnect(domains[i].client);
+        if (domains[i]->client)
+            dmbus_client_disconnect(domains[i]->client);
     }
 
     /* FIXME: for the moment only fds are released */
@@ -82,7 +82,7 @@ focus_initial_switch(struct domain *d)
         switcher_switch(d, 0, 0);
     }
     free( focus_uuid );
-    gettimeofday(&now,NULL);
+    monotonic_time(&now);
     d->last_input_event = now;
 
 }
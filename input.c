@@ -20,7 +20,8 @@
 
 #include "keyboard.h"
 
-#define EVENT_FILES         "/dev/input/event"
+#define EVENT_DIR           "/dev/input"
+#define EVENT_FILES         EVENT_DIR "/event"
 
 #define VALUE_KEY_UP     0
 #define VALUE_KEY_DOWN   1
@@ -40,6 +41,7 @@ static void wrapper_input_lock_timer(int fd, short event, void *opaque);
 static void send_config(struct domain *d, int slot);
 static void broadcast_config(long slot);
 static int input_check_secure_mode();
+static int input_state_init(void);
 static void dup_mouse_clicks(struct domain* d);
 static int check_mouse_keys(struct domain* d, int slot, struct input_event* e);
 
@@ -56,7 +58,10 @@ static int current_grab = 0;
 struct timeval global_last_input_event;
 
 int platform_lock_timeout = -1;
-static int resistance = -1;
+/* /mouse/speed and /keyboard/numlock-restore-on-switch, cached by
+ * input_settings_reload() and kept up to date by input_settings_refresh() */
+static int config_mouse_speed = DEFAULT_CONFIG_MOUSE_SPEED;
+static int config_numlock_restore = 1;
 
 static double mouse_x = 0;
 static double mouse_y = 0;
@@ -113,24 +118,57 @@ struct auth_input_state
     int current_field;
 };
 
+/* An open evdev node. The slot is the id guests and plugins know the
+ * device by, it stays the same for as long as the node is open. */
+struct input_device
+{
+    int slot;
+    int devnum;                 /* N of /dev/input/eventN, -1 if none */
+    int fd;
+    enum input_device_type type;
+    int grab;
+    struct event read_event;
+    struct tablet_state *tablet;
+    struct msg_input_config *config;    /* built once, for send_config() */
+    size_t config_size;
+    unsigned long keys[NBITS(KEY_CNT)]; /* keys and buttons seen down */
+    unsigned long packet_keys[NBITS(KEY_CNT)]; /* as of the last touchpad packet */
+    unsigned long absbits[NBITS(ABS_CNT)];      /* axes the device has */
+    int dropped;                /* skipping to the end of a SYN_DROPPED packet */
+};
+
 static struct input_dev
 {
-    enum input_device_type types[N_DEVS];
-    int fds[N_DEVS];
-    int grab[N_DEVS];
+    struct input_device **devices;      /* indexed by slot, NULL if free */
+    unsigned int ndevices;
     int key_status[KEY_STATUS_SIZE];
     struct input_binding *bindings;
     int nbinding;
     int secure_mode;            /* are keys being swallowed by dom0 */
     int collect_password;       /* are we collecting password */
     struct auth_input_state auth;
-    struct event device_events[N_DEVS];
 } input_dev;
 
 static struct timeval then = { 0, 0 };
 
 static struct event revert_to_auth_event, udev_monitor_event;
 
+/* udev events are collected for this long before acting on them, so
+ * docking a hub probes each of its devices once. */
+#define HOTPLUG_DELAY_MS        50
+#define HOTPLUG_ADD             (1 << 0)
+#define HOTPLUG_REMOVE          (1 << 1)
+
+struct hotplug
+{
+    int devnum;
+    uint8_t flags;
+};
+
+static struct event hotplug_event;
+static struct hotplug *hotplug_pending;
+static unsigned int hotplug_count, hotplug_size;
+
 static void timeout_start(void)
 {
     gettimeofday(&then, NULL);
@@ -147,17 +185,94 @@ static int timeout_expired(void)
 }
 
 
+static struct input_device *input_device(int slot)
+{
+    if (slot < 0 || (unsigned int) slot >= input_dev.ndevices)
+        return NULL;
+    return input_dev.devices[slot];
+}
+
+static enum input_device_type input_device_type(int slot)
+{
+    struct input_device *dev = input_device(slot);
+
+    return dev ? dev->type : 0;
+}
+
+static struct input_device *input_device_by_devnum(int devnum)
+{
+    unsigned int i;
+
+    for (i = 0; i < input_dev.ndevices; i++)
+        if (input_dev.devices[i] && input_dev.devices[i]->devnum == devnum)
+            return input_dev.devices[i];
+    return NULL;
+}
+
+/* Take slot, or the lowest free one if slot is negative. */
+static struct input_device *input_device_add(int slot)
+{
+    struct input_device *dev, **devices;
+    unsigned int n;
+
+    if (slot < 0)
+        for (slot = 0; (unsigned int) slot < input_dev.ndevices; slot++)
+            if (!input_dev.devices[slot])
+                break;
+    if (slot >= INPUT_SLOTS_MAX)
+    {
+        info("No free input slot, ignoring device");
+        return NULL;
+    }
+    if (input_device(slot))
+        return NULL;
+
+    if ((unsigned int) slot >= input_dev.ndevices)
+    {
+        n = input_dev.ndevices ? input_dev.ndevices * 2 : 16;
+        while (n <= (unsigned int) slot)
+            n *= 2;
+        if (n > INPUT_SLOTS_MAX)
+            n = INPUT_SLOTS_MAX;
+        devices = realloc(input_dev.devices, n * sizeof(*devices));
+        if (!devices)
+            return NULL;
+        memset(&devices[input_dev.ndevices], 0,
+               (n - input_dev.ndevices) * sizeof(*devices));
+        input_dev.devices = devices;
+        input_dev.ndevices = n;
+    }
+
+    dev = calloc(1, sizeof(*dev));
+    if (!dev)
+        return NULL;
+    dev->slot = slot;
+    dev->devnum = -1;
+    dev->fd = -1;
+    input_dev.devices[slot] = dev;
+    return dev;
+}
+
+static void input_device_free(struct input_device *dev)
+{
+    input_dev.devices[dev->slot] = NULL;
+    free(dev->tablet);
+    free(dev->config);
+    free(dev);
+}
+
 static void update_grabs(void)
 {
-    int i = 0;
+    struct input_device *dev;
+    unsigned int i;
 
-    for (i = 0; i < N_DEVS; i++)
-        if (input_dev.fds[i] != -1 && input_dev.grab[i] != current_grab)
+    for (i = 0; i < input_dev.ndevices; i++)
+        if ((dev = input_dev.devices[i]) && dev->fd != -1 && dev->grab != current_grab)
         {
-            if (ioctl(input_dev.fds[i], EVIOCGRAB, current_grab) == -1)
-                info("grab failed for event%d: %s", i, strerror(errno));
+            if (ioctl(dev->fd, EVIOCGRAB, current_grab) == -1)
+                info("grab failed for event%d: %s", dev->devnum, strerror(errno));
             else
-                input_dev.grab[i] = current_grab;
+                dev->grab = current_grab;
         }
 }
 
@@ -330,15 +445,191 @@ static inputevent_action demultitouch(struct input_event *e)
     return send_event;
 }
 
+/* Set while input_read() dispatches a read, batches are flushed at its end. */
+static int input_reading = 0;
+
+/* Remember whether the device model took the last message we sent it. */
+static void input_client_sent(struct domain *d, int rc)
+{
+    if (rc < 0)
+        monotonic_time(&d->client_stalled);
+    else
+        timerclear(&d->client_stalled);
+}
+
+#ifdef HAVE_DMBUS_INPUT_EVENT_BATCH
+/* dmbus batch messages end in a flexible array, these have room for a
+ * full batch. */
+static union
+{
+    struct msg_dom0_input_event_batch       msg;
+    char                                    space[sizeof (struct msg_dom0_input_event_batch) +
+                                                  INPUT_BATCH_MAX * sizeof (struct msg_dom0_input_event)];
+} batch_msg;
+
+#ifdef HAVE_DMBUS_INPUT_EVENT_TS
+static union
+{
+    struct msg_dom0_input_event_ts_batch    msg;
+    char                                    space[sizeof (struct msg_dom0_input_event_ts_batch) +
+                                                  INPUT_BATCH_MAX * sizeof (struct msg_dom0_input_event_ts)];
+} batch_ts_msg;
+
+static void input_flush_batch_ts(struct domain *d)
+{
+    struct input_batch *b = &d->batch;
+    struct msg_dom0_input_event_ts_batch *msg = &batch_ts_msg.msg;
+    uint32_t i;
+
+    for (i = 0; i < b->count; i++)
+    {
+        msg->events[i].sec = b->times[i].tv_sec;
+        msg->events[i].usec = b->times[i].tv_usec;
+        msg->events[i].type = b->events[i].type;
+        msg->events[i].code = b->events[i].code;
+        msg->events[i].value = b->events[i].value;
+    }
+    msg->count = b->count;
+
+    input_client_sent(d, dom0_input_event_ts_batch(d->client, msg,
+                              offsetof(struct msg_dom0_input_event_ts_batch, events) +
+                              msg->count * sizeof(msg->events[0])));
+    d->rate.msgs++;
+}
+#endif
+
+/* The events of a batch have left, measured from their evdev timestamps. */
+static void input_batch_latency(struct input_batch *b)
+{
+    uint32_t i;
+
+    for (i = 0; i < b->count; i++)
+        if (b->types[i] >= 0)
+            latency_record(b->types[i], LATENCY_DEST_DMBUS, &b->times[i]);
+}
+
+static void input_flush_batch(struct domain *d)
+{
+    struct input_batch *b = &d->batch;
+    struct msg_dom0_input_event_batch *msg = &batch_msg.msg;
+    uint32_t i;
+
+    if (!b->count)
+        return;
+
+    if (NULL == d->client)
+        ;
+#ifdef HAVE_DMBUS_INPUT_EVENT_TS
+    else if (d->input_caps & INPUT_CAP_TIMESTAMPS)
+        input_flush_batch_ts(d);
+#endif
+    else if (d->input_caps & INPUT_CAP_EVENT_BATCH)
+    {
+        msg->count = b->count;
+        memcpy(msg->events, b->events, b->count * sizeof(b->events[0]));
+        input_client_sent(d, dom0_input_event_batch(d->client, msg,
+                               offsetof(struct msg_dom0_input_event_batch, events) +
+                               msg->count * sizeof(msg->events[0])));
+        d->rate.msgs++;
+    }
+    else
+    {
+        for (i = 0; i < b->count; i++)
+            input_client_sent(d, dom0_input_event(d->client, &b->events[i],
+                                                  sizeof(b->events[i])));
+        d->rate.msgs += b->count;
+    }
+    if (NULL != d->client)
+        input_batch_latency(b);
+    b->count = 0;
+}
+#else
+/* Nothing is ever batched without libdmbus support for it. */
+static void input_flush_batch(struct domain *d)
+{
+}
+#endif
+
+/* time is the evdev timestamp of the event and type that of the device it
+ * was read from, NULL and -1 for ones we make up. */
+static void input_send_msg(struct domain *d, struct msg_dom0_input_event *msg,
+                           const struct timeval *time, int type)
+{
+    if (NULL == d->client)
+        return;
+
+    d->rate.events++;
+
+#ifdef HAVE_DMBUS_INPUT_EVENT_BATCH
+    if (d->input_caps)
+    {
+        struct input_batch *b = &d->batch;
+
+        if (time)
+            b->times[b->count] = *time;
+        else
+            timerclear(&b->times[b->count]);
+        b->types[b->count] = time ? type : -1;
+        b->events[b->count++] = *msg;
+
+        if (!(d->input_caps & INPUT_CAP_EVENT_BATCH) ||
+            (msg->type == EV_SYN && msg->code == SYN_REPORT) ||
+            (b->count == INPUT_BATCH_MAX) || !input_reading)
+            input_flush_batch(d);
+        return;
+    }
+#endif
+
+    input_client_sent(d, dom0_input_event(d->client, msg, sizeof(*msg)));
+    d->rate.msgs++;
+    if (time && type >= 0)
+        latency_record(type, LATENCY_DEST_DMBUS, time);
+}
+
+static void input_rate_sample(struct domain *d, const struct timeval *now)
+{
+    struct input_rate *r = &d->rate;
+    struct timeval diff;
+    unsigned long ms;
+
+    if (!timerisset(&r->since))
+    {
+        r->since = *now;
+        return;
+    }
+
+    timersub(now, &r->since, &diff);
+    if (diff.tv_sec < 1)
+        return;
+
+    ms = diff.tv_sec * 1000 + diff.tv_usec / 1000;
+    r->events_per_sec = r->events * 1000UL / ms;
+    r->msgs_per_sec = r->msgs * 1000UL / ms;
+    r->events = 0;
+    r->msgs = 0;
+    r->since = *now;
+}
+
+static void input_end_read(struct domain *d, void *opaque)
+{
+    if (d->is_pv_domain)
+        xen_event_flush(d->vkbd_backend);
+    if (d->plugin)
+        socket_plugin_flush(d);
+    input_flush_batch(d);
+    input_rate_sample(d, opaque);
+}
+
 static void send_config_reset(struct domain *d, uint8_t slot)
 {
     struct msg_input_config_reset msg;
     msg.slot = slot;
+    input_flush_batch(d);
     if (d->client)
         input_config_reset(d->client, &msg, sizeof(msg));
 
     if (d->plugin)
-       send_plugin_dev_event(d->plugin, DEV_RESET, slot); 
+        send_plugin_dev_events(d, DEV_RESET, slot);
 }
 
 
@@ -366,7 +657,7 @@ static void send_config_wrap(struct domain *d, void *o)
     int slot = (long) o;
     send_config(d, slot);
     if (d->plugin)
-        send_plugin_dev_event(d->plugin, DEV_CONF, slot);
+        send_plugin_dev_events(d, DEV_CONF, slot);
 }
 
 static void send_config_reset_wrap(struct domain *d, void *o)
@@ -385,12 +676,15 @@ static void broadcast_config(long slot)
     iterate_domains(send_config_wrap, (void *) slot);
 }
 
-static void send_config(struct domain *d, int slot)
+/* Build the input_config message describing a device. Devices don't
+ * change what they can do, so this is done once and kept with it. */
+static struct msg_input_config *input_config_build(struct input_device *dev, size_t *size)
 {
     int rc = 0;
     size_t i;
-    int fd = input_dev.fds[slot];
-    enum input_device_type type = input_dev.types[slot];
+    int slot = dev->slot;
+    int fd = dev->fd;
+    enum input_device_type type = dev->type;
     unsigned long eventtypes[NBITS(EV_MAX)];
     unsigned long abslimits[NBITS(ABS_MAX)];
     unsigned long rellimits[NBITS(REL_MAX)];
@@ -401,14 +695,10 @@ static void send_config(struct domain *d, int slot)
     size_t msg_size = 0;
     unsigned char *raw;
 
-    /* QEMU is the only consumer. */
-    if (!d || d->is_pv_domain)
-        return;
-
     rc = ioctl(fd, EVIOCGBIT(0, sizeof (eventtypes)), eventtypes);
     if (rc < 0) {
         info("Failed to get input event types (%s).\n", strerror(errno));
-        return;
+        return NULL;
     }
 
     memset(eventtypes, 0, sizeof (eventtypes));
@@ -538,9 +828,28 @@ static void send_config(struct domain *d, int slot)
         memcpy(raw, keylimits, sizeof (keylimits));
         raw += sizeof (keylimits);
     }
+
+    *size = msg_size;
+    return msg;
+}
+
+static void send_config(struct domain *d, int slot)
+{
+    struct input_device *dev = input_device(slot);
+
+    /* QEMU is the only consumer. */
+    if (!d || d->is_pv_domain || !dev)
+        return;
+
+    /* Devices set up for input_bench never went through consider_device() */
+    if (!dev->config)
+        dev->config = input_config_build(dev, &dev->config_size);
+    if (!dev->config)
+        return;
+
     /* Send to QEMU. */
-    input_config(d->client, msg, msg_size);
-    free(msg);
+    input_flush_batch(d);
+    input_config(d->client, dev->config, dev->config_size);
 }
 
 static void send_slot(struct domain *d)
@@ -553,22 +862,23 @@ static void send_slot(struct domain *d)
     msg.type = EV_DEV;
     msg.code = DEV_SET;
     msg.value = d->last_devslot;
-    dom0_input_event(d->client, &msg, sizeof(msg));
+    input_send_msg(d, &msg, NULL, -1);
 }
 
-static void input_send(struct domain *d, int slot, struct input_event *e)
+/* Type to account an event's latency to, where it leaves. Only events
+ * read from a device carry a kernel timestamp worth measuring, -1 for the
+ * rest. */
+static int input_latency_type(int slot)
 {
-    struct msg_dom0_input_event msg;
-    if (!d)
-        return;
+    return input_device(slot) ? (int) input_device_type(slot) : -1;
+}
 
-    if (d->plugin)
-        {
-        send_plugin_event(d,slot,e);
-        return;
-        }
+/* Hand an event to the guest itself, over dmbus or xen_vkbd. */
+static void input_deliver(struct domain *d, int slot, struct input_event *e)
+{
+    struct msg_dom0_input_event msg;
 
-    if ((!(d->is_pv_domain))  && (d->last_devslot!=slot))
+    if ((!(d->is_pv_domain)) && (slot != INPUTSLOT_INVALID) && (d->last_devslot!=slot))
     {
         d->last_devslot = slot;
         send_slot(d);
@@ -589,7 +899,10 @@ static void input_send(struct domain *d, int slot, struct input_event *e)
             ia = demultitouch(e);
             if (ia == discared_event)
                 return;
-            xen_vkbd_send_event(d, e);
+            /* Latency is taken when the frontend is kicked. */
+            xen_vkbd_send_event(d, e, input_latency_type(slot));
+            if (!input_reading)
+                xen_event_flush(d->vkbd_backend);
         }
         else
         {
@@ -598,15 +911,197 @@ static void input_send(struct domain *d, int slot, struct input_event *e)
             msg.code = e->code;
             msg.value = e->value;
 
-            if (NULL != d->client)
-                dom0_input_event(d->client, &msg, sizeof(msg));
+            /* Latency is taken when the batch holding it is sent. */
+            input_send_msg(d, &msg, &e->time, input_latency_type(slot));
         }
     }
     while (ia == events_queued);
 }
 
+static void input_send_now(struct domain *d, int slot, struct input_event *e)
+{
+    if (d->plugin)
+        {
+        /* Latency is taken when the plugin is handed the event. */
+        send_plugin_event(d, slot, e, input_latency_type(slot));
+        return;
+        }
+
+    input_deliver(d, slot, e);
+}
+
+/*
+ * Events a plugin writes back go through the same delivery as device
+ * input. A plugin recv is bracketed like a device read, so that frames
+ * are batched and flushed once at the end.
+ */
+void input_plugin_send(struct domain *d, struct input_event *e)
+{
+    /* Slots mean nothing to xen_vkbd. */
+    if (d->is_pv_domain && (!d->vkbd_backend || e->type == EV_DEV))
+        return;
+
+    input_deliver(d, INPUTSLOT_INVALID, e);
+}
+
+void input_plugin_begin(void)
+{
+    input_reading = 1;
+}
+
+void input_plugin_end(void)
+{
+    struct timeval now;
+
+    input_reading = 0;
+    monotonic_time(&now);
+    iterate_domains(input_end_read, &now);
+}
+
+/* How often a held motion frame is retried while the domain is busy */
+#define COALESCE_RETRY_MS 5
+
+/* Whether the domain still has undelivered input sitting in front of it. */
+static int input_domain_busy(struct domain *d)
+{
+    struct timeval now, diff;
+
+    if (d->is_pv_domain)
+        return xen_event_busy(d->vkbd_backend);
+
+    if (d->plugin)
+        return socket_plugin_busy(d);
+    if (!d->client || !timerisset(&d->client_stalled))
+        return 0;
+
+    /* A device model that failed to take a message is given a retry
+     * period before it is sent to again. */
+    monotonic_time(&now);
+    timersub(&now, &d->client_stalled, &diff);
+    return diff.tv_sec == 0 && diff.tv_usec < COALESCE_RETRY_MS * 1000;
+}
+
+static void input_coalesce_send(struct domain *d, int type, int code, int value)
+{
+    struct input_event e;
+
+    e.time = d->coalesce.time;
+    e.type = type;
+    e.code = code;
+    e.value = value;
+    input_send_now(d, d->coalesce.slot, &e);
+}
+
+static void input_coalesce_flush(struct domain *d)
+{
+    struct input_coalesce *c = &d->coalesce;
+    unsigned int code;
+
+    if (!c->pending)
+        return;
+
+    for (code = 0; code < ARRAY_LEN(c->rel); code++)
+        if (c->relmask & (1U << code))
+            input_coalesce_send(d, EV_REL, code, c->rel[code]);
+
+    for (code = 0; code < ARRAY_LEN(c->abs); code++)
+        if (c->absmask & (1ULL << code))
+            input_coalesce_send(d, EV_ABS, code, c->abs[code]);
+
+    if (c->synced)
+        input_coalesce_send(d, EV_SYN, SYN_REPORT, 0);
+
+    memset(c->rel, 0, sizeof (c->rel));
+    c->relmask = 0;
+    c->absmask = 0;
+    c->pending = false;
+    c->synced = false;
+
+    if (evtimer_initialized(&c->retry_event))
+        evtimer_del(&c->retry_event);
+}
+
+static void input_coalesce_retry(int fd, short event, void *opaque)
+{
+    struct domain *d = opaque;
+    struct timeval tv = { 0, COALESCE_RETRY_MS * 1000 };
+
+    if (input_domain_busy(d))
+        evtimer_add(&d->coalesce.retry_event, &tv);
+    else
+        input_coalesce_flush(d);
+}
+
+/* Hold back pointer motion while the domain is busy. Returns 1 if the
+ * event was absorbed, 0 if it must be sent now (after anything held). */
+static int input_coalesce(struct domain *d, int slot, struct input_event *e)
+{
+    struct input_coalesce *c = &d->coalesce;
+    struct timeval tv = { 0, COALESCE_RETRY_MS * 1000 };
+
+    if (c->pending && c->slot != slot)
+        input_coalesce_flush(d);
+
+    switch (e->type)
+    {
+    case EV_REL:
+        if (e->code >= ARRAY_LEN(c->rel))
+            break;
+        c->rel[e->code] += e->value;
+        c->relmask |= 1U << e->code;
+        goto held;
+    case EV_ABS:
+        if (e->code >= ARRAY_LEN(c->abs))
+            break;
+        c->abs[e->code] = e->value;
+        c->absmask |= 1ULL << e->code;
+        goto held;
+    case EV_SYN:
+        if (e->code != SYN_REPORT || !c->pending)
+            break;
+        if (input_domain_busy(d))
+        {
+            c->synced = true;
+            if (!evtimer_initialized(&c->retry_event))
+                evtimer_set(&c->retry_event, input_coalesce_retry, d);
+            evtimer_add(&c->retry_event, &tv);
+            return 1;
+        }
+        /* This SYN_REPORT closes the frame being flushed. */
+        c->synced = false;
+        break;
+    }
+
+    /* Key and button edges, MT axes, and frame ends: keep strict order. */
+    input_coalesce_flush(d);
+    return 0;
+
+held:
+    c->pending = true;
+    c->slot = slot;
+    c->time = e->time;
+    return 1;
+}
+
+static void input_send(struct domain *d, int slot, struct input_event *e)
+{
+    if (!d)
+        return;
+
+    if (d->coalesce.enabled && input_coalesce(d, slot, e))
+        return;
+
+    input_send_now(d, slot, e);
+}
+
 void input_domain_gone(struct domain *d)
 {
+    if (evtimer_initialized(&d->coalesce.retry_event))
+        evtimer_del(&d->coalesce.retry_event);
+    d->coalesce.pending = false;
+
+    socket_domain_gone(d);
+
     if (mouse_dest == d)
     {
         info("lost the mouse domain, ditching mouse_events for now");
@@ -653,6 +1148,7 @@ static void input_keyboard_reset(int reset_mouse_domain)
         return;
 
     info("input_keyboard_reset\n");
+    gettimeofday(&e.time, NULL);
     for (i = 0; i < KEY_STATUS_SIZE; i++)
         if (input_dev.key_status[i])
         {
@@ -683,6 +1179,7 @@ void send_keypair(struct keypairs *key, struct domain *d)
     uint32_t *m = &d->divert_info->modifers[1];
     int i;
 
+    gettimeofday(&e.time, NULL);
     e.type = EV_KEY;
     e.value = 1;
 
@@ -895,7 +1392,7 @@ void input_set(struct domain *d)
         info("keyboard input now directed to domid %d", get_keyb_dest() ? get_keyb_dest()->domid : -1);
         info("mouse input now directed to domid %d", mouse_dest ? mouse_dest->domid : -1);
     }
-    gettimeofday(&now, NULL);
+    monotonic_time(&now);
     d->last_input_event = now;
 
 }
@@ -1008,6 +1505,7 @@ void turn_numlock_off(void)
     {
         get_keyb_dest()->keyboard_led_code = ((get_keyb_dest()->keyboard_led_code) & (~LED_CODE_NUMLOCK));
 
+        gettimeofday(&e.time, NULL);
         e.type = EV_KEY;
         e.code = KEY_NUMLOCK;
         e.value = 1;
@@ -1067,7 +1565,7 @@ static inline int event_is_key(struct input_event *e)
 static inline int event_is_keyboard(int slot, struct input_event *e)
 {   
     static int last_was_key=1;
-    if (slot>=0 && input_dev.types[slot] != HID_TYPE_KEYBOARD)
+    if (slot>=0 && input_device_type(slot) != HID_TYPE_KEYBOARD)
     {
         last_was_key=0;
         return false;
@@ -1302,15 +1800,41 @@ static void compute_mouse_speed(void)
     mouse_speed_threshold_2 = mult_threshold_2 * mouse_speed;
 }
 
-int input_get_mouse_speed(void)
+static void input_setting_mouse_speed(const char *value, void *opaque)
+{
+    config_mouse_speed = *value ? strtol(value, NULL, 10) : DEFAULT_CONFIG_MOUSE_SPEED;
+    compute_mouse_speed();
+}
+
+/* Restore numlock state on switch by default. */
+static void input_setting_numlock_restore(const char *value, void *opaque)
+{
+    config_numlock_restore = !*value || (strcmp("true", value) == 0);
+}
+
+static void input_settings_reload(void)
 {
     char buf[16];
 
-    int ret = db_read(buf, sizeof(buf), "/mouse/speed");
-    if ((ret == 0) || (strlen(buf) == 0))
-        sprintf(buf, "%d", DEFAULT_CONFIG_MOUSE_SPEED);
+    db_read(buf, sizeof(buf), "/mouse/speed");
+    buf[sizeof(buf) - 1] = 0;
+    input_setting_mouse_speed(buf, NULL);
+
+    db_read(buf, sizeof(buf), "/keyboard/numlock-restore-on-switch");
+    buf[sizeof(buf) - 1] = 0;
+    input_setting_numlock_restore(buf, NULL);
+}
+
+/* Same as input_settings_reload(), without waiting for dbd. */
+void input_settings_refresh(void)
+{
+    db_read_async("/mouse/speed", input_setting_mouse_speed, NULL);
+    db_read_async("/keyboard/numlock-restore-on-switch", input_setting_numlock_restore, NULL);
+}
 
-    return strtol(buf, NULL, 10);
+int input_get_mouse_speed(void)
+{
+    return config_mouse_speed;
 }
 
 void input_set_mouse_speed(int speed)
@@ -1324,24 +1848,19 @@ void input_set_mouse_speed(int speed)
 
     sprintf(buf, "%d", speed);
     db_write("/mouse/speed", buf);
+    config_mouse_speed = speed;
     compute_mouse_speed();
 }
 
 int input_get_numlock_restore_on_switch(void)
 {
-    char buf[16];
-
-    /* Restore numlock state on switch by default. */
-    int ret = db_read(buf, sizeof(buf), "/keyboard/numlock-restore-on-switch");
-    if ((ret == 0) || (strlen(buf) == 0))
-        return 1;
-
-    return (strcmp("true", buf) == 0);
+    return config_numlock_restore;
 }
 
 void input_set_numlock_restore_on_switch(int restore)
 {
     db_write("/keyboard/numlock-restore-on-switch", restore ? "true" : "false");
+    config_numlock_restore = !!restore;
 }
 
 static void force_range(double *x, int b, int e)
@@ -1764,19 +2283,7 @@ void input_inject(struct input_event *e, int slot, enum input_device_type input_
         {
 
             /* To mouse-switch, last event must be a large-enough X movement */
-            /* Unless specified in the db, resistance is 10 */
-            if (resistance == -1)
-            {
-                char buf[16] = { 0 };
-                if (db_exists("/switcher/resistance"))
-                {
-                    db_read(buf, 16, "/switcher/resistance");
-                    resistance = strtol(buf, NULL, 0);
-                }
-                else
-                    resistance = 10;
-            }
-            if (abs(val) > resistance)
+            if (abs(val) > switcher_resistance())
                 switcher_switch_on_mouse(e, (int) mouse_x, (int) mouse_y);
         }
 
@@ -1797,16 +2304,17 @@ void input_inject(struct input_event *e, int slot, enum input_device_type input_
 static void input_led(int onoff, int led)
 {
     struct input_event ev;
-    int i = 0;
+    struct input_device *dev;
+    unsigned int i = 0;
 
     memset(&ev, 0, sizeof(ev));
-    for (i = 0; i < N_DEVS; i++)
-        if (input_dev.types[i] == HID_TYPE_KEYBOARD)
+    for (i = 0; i < input_dev.ndevices; i++)
+        if ((dev = input_dev.devices[i]) && dev->type == HID_TYPE_KEYBOARD)
         {
             ev.type = EV_LED;
             ev.code = led;
             ev.value = onoff;
-            (void)!write(input_dev.fds[i], &ev, sizeof(struct input_event));
+            (void)!write(dev->fd, &ev, sizeof(struct input_event));
         }
 }
 
@@ -1925,7 +2433,7 @@ static void input_exec_bindings_or_inject(struct input_event *e, int slot, enum
 {
     if (!input_exec_bindings(e))
     {
-        if (input_dev.types[slot] == HID_TYPE_KEYBOARD)
+        if (input_device_type(slot) == HID_TYPE_KEYBOARD)
             slot = INPUTSLOT_DEFAULT;
         /* sequence has not matched, inject the event into vm */
         input_inject(e, slot, input_type);
@@ -2443,40 +2951,158 @@ void check_and_inject_event(struct input_event *e, int slot, enum input_device_t
 }
 
 
-static void input_read(void *opaque)
+static void input_route_events(int slot, struct input_event *event, unsigned int n);
+
+/* Current value of an axis. For multitouch axes, that of the contact in
+ * the current slot, which is what the touchpad code follows. EVIOCGABS
+ * answers zeros for axes the device does not have, so those are checked
+ * against its capabilities first. */
+static int input_abs_value(struct input_device *dev, unsigned int code, int32_t *value)
 {
-    int slot = (long) opaque;
-    struct input_event event[64];
-    unsigned int i = 0;
-    int read_sz = 0;
-    int inject = 1;
-    int32_t focused;
+    struct input_absinfo abs;
+    int32_t mt[1 + INPUT_MT_SLOTS];
+    int fd = dev->fd;
+
+    if (!TEST_BIT(code, dev->absbits))
+        return -1;
 
-    memset(event, 0, sizeof(event));
-    if ((read_sz = read(input_dev.fds[slot], event, sizeof(event))) <= 0)
+    if (code < ABS_MT_SLOT)
     {
-        info("read failed from event%d (returned %d) Dropping device.", slot, read_sz);
-        event_del(&input_dev.device_events[slot]);
-        close(input_dev.fds[slot]);
-        input_dev.fds[slot] = -1;
-        broadcast_removed_dev(slot);
-        return;
+        if (ioctl(fd, EVIOCGABS(code), &abs) < 0)
+            return -1;
+        *value = abs.value;
+        return 0;
     }
 
-    input_lock_timer((void *) 0);
+    if (!TEST_BIT(ABS_MT_SLOT, dev->absbits) ||
+        ioctl(fd, EVIOCGABS(ABS_MT_SLOT), &abs) < 0 ||
+        abs.value < 0 || abs.value >= INPUT_MT_SLOTS)
+        return -1;
+    mt[0] = code;
+    if (ioctl(fd, EVIOCGMTSLOTS(sizeof (mt)), mt) < 0)
+        return -1;
+    *value = mt[1 + abs.value];
+    return 0;
+}
+
+/*
+ * The kernel dropped events for dev and the rest of that packet has been
+ * skipped. Ask the device what state it is really in and route whatever
+ * it takes to get there from what we last saw: key and button changes,
+ * and for touchpads where the finger is now, as one packet.
+ */
+static void input_resync_device(struct input_device *dev, const struct timeval *time)
+{
+    static struct input_event event[KEY_CNT + 4];
+    static const unsigned int touchpad_axes[][2] = {
+        { ABS_X, ABS_MT_POSITION_X },
+        { ABS_Y, ABS_MT_POSITION_Y },
+        { ABS_PRESSURE, ABS_MT_PRESSURE },
+    };
+    unsigned long keys[NBITS(KEY_CNT)];
+    unsigned int code, i, n = 0, nkeys;
+    int32_t value;
+
+    if (ioctl(dev->fd, EVIOCGKEY(sizeof (keys)), keys) < 0)
+        memcpy(keys, dev->keys, sizeof (keys));
+
+    for (code = 0; code < KEY_CNT; code++)
+        if (!TEST_BIT(code, keys) != !TEST_BIT(code, dev->keys))
+        {
+            event[n].time = *time;
+            event[n].type = EV_KEY;
+            event[n].code = code;
+            event[n].value = !!TEST_BIT(code, keys);
+            n++;
+        }
+    nkeys = n;
+
+    if (dev->type == HID_TYPE_TOUCHPAD)
+    {
+        touchpad_resync();
+        for (i = 0; i < ARRAY_LEN(touchpad_axes); i++)
+            if (!input_abs_value(dev, touchpad_axes[i][0], &value) ||
+                !input_abs_value(dev, touchpad_axes[i][1], &value))
+            {
+                event[n].time = *time;
+                event[n].type = EV_ABS;
+                event[n].code = touchpad_axes[i][0];
+                event[n].value = value;
+                n++;
+            }
+    }
+
+    event[n].time = *time;
+    event[n].type = EV_SYN;
+    event[n].code = SYN_REPORT;
+    event[n].value = 0;
+    n++;
+
+    info("event%d: resynced after SYN_DROPPED, %u keys changed", dev->devnum, nkeys);
+    input_route_events(dev->slot, event, n);
+}
+
+/* Returns whether e was taken care of as part of a SYN_DROPPED recovery.
+ * Tablets forward SYN_DROPPED to the guest themselves. */
+static int input_dropped(struct input_device *dev, struct input_event *e)
+{
+    if (!dev || dev->type == HID_TYPE_TABLET)
+        return 0;
+
+    if (e->type == EV_SYN && e->code == SYN_DROPPED)
+    {
+        info("event%d: SYN_DROPPED, skipping to the next packet", dev->devnum);
+        dev->dropped = 1;
+        /* The touchpad code throws away the partial packet, keys included */
+        if (dev->type == HID_TYPE_TOUCHPAD)
+            memcpy(dev->keys, dev->packet_keys, sizeof (dev->keys));
+        return 1;
+    }
+    if (!dev->dropped)
+        return 0;
+
+    /* What came between SYN_DROPPED and SYN_REPORT is a partial packet */
+    if (e->type == EV_SYN && e->code == SYN_REPORT)
+    {
+        dev->dropped = 0;
+        input_resync_device(dev, &e->time);
+    }
+    return 1;
+}
+
+/* Route a run of events read from slot. */
+static void input_route_events(int slot, struct input_event *event, unsigned int n)
+{
+    struct input_device *dev = input_device(slot);
+    unsigned int i = 0;
+    int inject = 1;
 
-    for (i = 0; i < read_sz / (sizeof(struct input_event)); i++)
+    for (i = 0; i < n; i++)
     {
+        if (input_dropped(dev, &event[i]))
+            continue;
+
+        if (dev && event[i].type == EV_KEY && event[i].code < KEY_CNT)
+        {
+            if (event[i].value == 1)
+                BIT_SET(event[i].code, dev->keys);
+            else if (event[i].value == 0)
+                BIT_CLR(event[i].code, dev->keys);
+        }
+        else if (dev && dev->type == HID_TYPE_TOUCHPAD &&
+                 event[i].type == EV_SYN && event[i].code == SYN_REPORT)
+            memcpy(dev->packet_keys, dev->keys, sizeof (dev->keys));
+
         input_keys_status(&event[i]);
 
-        enum input_device_type input_type = input_dev.types[slot];
+        enum input_device_type input_type = input_device_type(slot);
 
         inject = !input_secure_mode(&event[i], input_type);
 
         if (input_type == HID_TYPE_TOUCHPAD)
             handle_touchpad_event(&event[i], slot);
         else if (input_type == HID_TYPE_TABLET)
-            handle_usb_tablet_event(&event[i], slot);
+            handle_usb_tablet_event(&event[i], slot, input_device(slot)->tablet);
         else if (inject)
         {
             if (input_type == HID_TYPE_THINKPAD_ACPI)
@@ -2485,8 +3111,16 @@ static void input_read(void *opaque)
                 input_exec_bindings_or_inject(&event[i], slot, input_type);
         }
     }
+}
 
-    gettimeofday(&global_last_input_event, NULL);
+/* Once the reads are done: hand over what they queued up and note the
+ * input for idle accounting. */
+static void input_end_reads(void)
+{
+    int32_t focused;
+
+    monotonic_time(&global_last_input_event);
+    iterate_domains(input_end_read, &global_last_input_event);
 
     /*update last_input_event time */
     focused = switcher_get_focus();
@@ -2500,6 +3134,74 @@ static void input_read(void *opaque)
     }
 }
 
+void input_process_events(int slot, struct input_event *event, unsigned int n)
+{
+    input_lock_timer((void *) 0);
+
+    input_reading = 1;
+    input_route_events(slot, event, n);
+    input_reading = 0;
+
+    input_end_reads();
+}
+
+static void input_drop_device(struct input_device *dev)
+{
+    int slot = dev->slot;
+
+    event_del(&dev->read_event);
+    close(dev->fd);
+    input_device_free(dev);
+    broadcast_removed_dev(slot);
+}
+
+/* Events taken per read(), and reads per wakeup before other devices get
+ * their turn. evdev only copies out what is queued, so a large buffer
+ * costs nothing on a quiet device and drains a busy one in one go. */
+#define INPUT_READ_EVENTS       1024
+#define INPUT_READS_MAX         4
+
+static void input_read(void *opaque)
+{
+    static struct input_event event[INPUT_READ_EVENTS];
+    struct input_device *dev = opaque;
+    int slot = dev->slot;
+    ssize_t read_sz = 0;
+    int reads = 0;
+    int drop = 0;
+
+    input_lock_timer((void *) 0);
+
+    input_reading = 1;
+    while (reads++ < INPUT_READS_MAX)
+    {
+        read_sz = read(dev->fd, event, sizeof(event));
+        if (read_sz < 0 && errno == EINTR)
+            continue;
+        if (read_sz <= 0)
+        {
+            /* Decide now, flushing the batches below may clobber errno. */
+            drop = read_sz == 0 || errno != EAGAIN;
+            break;
+        }
+
+        input_route_events(slot, event, read_sz / sizeof(struct input_event));
+
+        /* A short read means the queue is empty, no need for an EAGAIN */
+        if ((size_t) read_sz < sizeof(event))
+            break;
+    }
+    input_reading = 0;
+
+    input_end_reads();
+
+    if (drop)
+    {
+        info("read failed from event%d (returned %zd) Dropping device.", dev->devnum, read_sz);
+        input_drop_device(dev);
+    }
+}
+
 /* revert screen to authentication vm */
 static void revert_to_auth(void *opaque)
 {
@@ -2739,9 +3441,18 @@ static bool devices_blacklist(unsigned int bustype, const char *name)
     return false;
 }
 
-static int consider_device(long slot)
+/* Device reads run ahead of the control plane on the event loop. */
+static void input_watch_device(struct input_device *dev)
 {
-    int fd = input_dev.fds[slot];
+    event_set(&dev->read_event, dev->fd, EV_READ | EV_PERSIST, wrapper_input_read, dev);
+    event_priority_set(&dev->read_event, EVENT_PRIORITY_INPUT);
+    event_add(&dev->read_event, NULL);
+}
+
+static int consider_device(struct input_device *dev)
+{
+    int slot = dev->slot;
+    int fd = dev->fd;
     int ret = 0;
 
     char name[128] = { 0 };
@@ -2760,34 +3471,40 @@ static int consider_device(long slot)
         return -1;
 
     if (!ioctl(fd, EVIOCGRAB, current_grab))
-        input_dev.grab[slot] = current_grab;
+        dev->grab = current_grab;
+
+    /* Keys already held down, so a SYN_DROPPED resync diffs against the
+     * real state rather than an all-up one. */
+    if (ioctl(fd, EVIOCGKEY(sizeof (dev->keys)), dev->keys) < 0)
+        memset(dev->keys, 0, sizeof (dev->keys));
+    memcpy(dev->packet_keys, dev->keys, sizeof (dev->keys));
+    if (ioctl(fd, EVIOCGBIT(EV_ABS, sizeof (dev->absbits)), dev->absbits) < 0)
+        memset(dev->absbits, 0, sizeof (dev->absbits));
 
     if (device_is_thinkpad_acpi(id.bustype, name))
     {
-        info("event%d added thinkpad acpi device on fd %d (%s)", slot, fd, name);
-        input_dev.types[slot] = HID_TYPE_THINKPAD_ACPI;
+        info("event%d added thinkpad acpi device on fd %d (%s)", dev->devnum, fd, name);
+        dev->type = HID_TYPE_THINKPAD_ACPI;
 
-        event_set(&input_dev.device_events[slot], fd, EV_READ | EV_PERSIST, wrapper_input_read, (void *) slot);
-        event_add(&input_dev.device_events[slot], NULL);
+        input_watch_device(dev);
         return 0;
     }
 
     if (device_is_lid_switch(id.bustype, name))
     {
-        info("event%d added lid switch on fd %d (%s)", slot, fd, name);
+        info("event%d added lid switch on fd %d (%s)", dev->devnum, fd, name);
         lid_create_switch_event(fd);
-        input_dev.fds[slot] = -1;
+        dev->fd = -1;
         return 0;
     }
 
     ret = find_keyboard_device(fd, id.bustype, name);
     if (ret == HID_TYPE_KEYBOARD)
     {
-        info("event%d added keyboard on fd %d (%s)", slot, fd, name);
-        input_dev.types[slot] = HID_TYPE_KEYBOARD;
+        info("event%d added keyboard on fd %d (%s)", dev->devnum, fd, name);
+        dev->type = HID_TYPE_KEYBOARD;
 
-        event_set(&input_dev.device_events[slot], fd, EV_READ | EV_PERSIST, wrapper_input_read, (void *) slot);
-        event_add(&input_dev.device_events[slot], NULL);
+        input_watch_device(dev);
 
         /* Set the keyboard LEDs. */
         if (get_keyb_dest() != NULL)
@@ -2816,29 +3533,83 @@ static int consider_device(long slot)
         if (init_touchpad(fd) < 0)
             return -1;
 
-        info("event%d added touchpad on fd %d (%s)", slot, fd, name);
-        input_dev.types[slot] = HID_TYPE_TOUCHPAD;
+        info("event%d added touchpad on fd %d (%s)", dev->devnum, fd, name);
+        dev->type = HID_TYPE_TOUCHPAD;
     }
     else if (ret == HID_TYPE_TABLET)
     {
-        if (init_usb_tablet(fd, slot, subtype) < 0)
+        if (!(dev->tablet = init_usb_tablet(fd, subtype)))
             return -1;
 
-        info("event%d added usb tablet on fd %d (%s)", slot, fd, name);
-        input_dev.types[slot] = HID_TYPE_TABLET;
+        info("event%d added usb tablet on fd %d (%s)", dev->devnum, fd, name);
+        dev->type = HID_TYPE_TABLET;
     }
     else                        /* HID_TYPE_MOUSE */
     {
-        info("event%d added mouse on fd %d (%s)", slot, fd, name);
-        input_dev.types[slot] = HID_TYPE_MOUSE;
+        info("event%d added mouse on fd %d (%s)", dev->devnum, fd, name);
+        dev->type = HID_TYPE_MOUSE;
     }
 
+    dev->config = input_config_build(dev, &dev->config_size);
     broadcast_config(slot);
-    event_set(&input_dev.device_events[slot], fd, EV_READ | EV_PERSIST, wrapper_input_read, (void *) slot);
+    input_watch_device(dev);
+
+    return 0;
+}
+
+/*
+ * Replay support for input_bench: set up a slot the way consider_device()
+ * would, without grabbing or watching anything. Pointer capabilities come
+ * from fd when the captured device is available, otherwise from type and
+ * the ranges the caller took from the capture.
+ */
+int input_replay_device(int slot, int fd, enum input_device_type type,
+                        const struct input_ranges *ranges)
+{
+    struct input_device *dev;
+    uint8_t subtype = SUBTYPE_NONE;
+    int ret;
+
+    if (slot < 0 || !(dev = input_device_add(slot)))
+        return -1;
 
-    event_add(&input_dev.device_events[slot], NULL);
+    if (fd >= 0 && type != HID_TYPE_KEYBOARD)
+    {
+        if ((ret = find_pointer_device_type(fd, 0, &subtype)) < 0)
+            goto fail;
+        type = ret;
+    }
+
+    if (type == HID_TYPE_TOUCHPAD)
+    {
+        if (fd >= 0)
+            ret = init_touchpad(fd);
+        else
+            ret = ranges ? init_touchpad_ranges(ranges) : -1;
+        if (ret < 0)
+            goto fail;
+    }
+    if (type == HID_TYPE_TABLET)
+    {
+        if (fd >= 0)
+            dev->tablet = init_usb_tablet(fd, subtype);
+        else if (ranges)
+            dev->tablet = init_usb_tablet_ranges(&ranges->x, &ranges->y, subtype);
+        if (!dev->tablet)
+            goto fail;
+    }
 
+    dev->type = type;
     return 0;
+
+fail:
+    input_device_free(dev);
+    return -1;
+}
+
+int input_replay_init(void)
+{
+    return input_state_init();
 }
 
 static void wrapper_input_read(int fd, short event, void *opaque)
@@ -2851,48 +3622,79 @@ static void wrapper_force_timer(int fd, short event, void *opaque)
     force_timer(opaque);
 }
 
-static void input_scan(void *unused)
+/* N of an "eventN" device name, -1 for anything else. */
+static int input_event_devnum(const char *name)
 {
+    char *end;
+    long n;
+
+    if (strncmp(name, "event", 5))
+        return -1;
+    n = strtol(name + 5, &end, 10);
+    if (end == name + 5 || *end || n < 0 || n > INT_MAX)
+        return -1;
+    return n;
+}
+
+/* Open and set up eventN, unless it is already open. */
+static int input_probe_device(int devnum)
+{
+    struct input_device *dev;
     char name[128];
-    int i;
-    struct timeval tv;
+    long arg = 0;
+    int fd;
 
+    /* Do we already have this device open and working */
+    if (input_device_by_devnum(devnum))
+        return 0;
 
-    for (i = 0; i < N_DEVS; i++)
-    {
-        /* Do we already have this device open and working */
-        if (input_dev.fds[i] >= 0)
-            continue;
+    sprintf(name, EVENT_FILES "%d", devnum);
+    /* Check to see if we can open it */
+    fd = open(name, O_RDWR);
+    if (fd < 0)
+        return -1;
 
-        sprintf(name, EVENT_FILES "%d", i);
-        /* Check to see if we can open it */
-        input_dev.fds[i] = open(name, O_RDWR);
-        if (input_dev.fds[i] < 0)
-            continue;
+    /* Switch to NBIO */
+    arg = fcntl(fd, F_GETFL, arg);
+    arg |= O_NONBLOCK;
+    fcntl(fd, F_SETFL, arg);
 
-        /* Switch to NBIO */
-        {
-            long arg = 0;
-            arg = fcntl(input_dev.fds[i], F_GETFL, arg);
-            arg |= O_NONBLOCK;
-            fcntl(input_dev.fds[i], F_SETFL, arg);
-        }
+    if (!(dev = input_device_add(-1)))
+    {
+        close(fd);
+        return -1;
+    }
+    dev->devnum = devnum;
+    dev->fd = fd;
 
-        if (consider_device(i))
-        {
-            close(input_dev.fds[i]);
-            input_dev.fds[i] = -1;
-            continue;
-        }
+    if (consider_device(dev))
+    {
+        close(fd);
+        input_device_free(dev);
+        return -1;
     }
 
-#if 0
-    if (!scan_timer)
-        scan_timer = set_new_timer(input_scan, NULL);
-    gettimeofday(&tv, NULL);
-    tv.tv_sec += 5;
-    set_timer(scan_timer, &tv);
-#endif
+    /* Handed over elsewhere, like the lid switch: no slot needed */
+    if (dev->fd < 0)
+        input_device_free(dev);
+    return 0;
+}
+
+static void input_scan(void *unused)
+{
+    struct dirent *de;
+    DIR *dir;
+    int devnum;
+
+    if (!(dir = opendir(EVENT_DIR)))
+    {
+        info("Can't list " EVENT_DIR ": %s", strerror(errno));
+        return;
+    }
+    while ((de = readdir(dir)) != NULL)
+        if ((devnum = input_event_devnum(de->d_name)) >= 0)
+            input_probe_device(devnum);
+    closedir(dir);
 }
 
 void input_add_binding(const int tab[], input_binding_cb_t cb, input_binding_cb_t force_cb, void *opaque)
@@ -2918,22 +3720,84 @@ void input_add_binding(const int tab[], input_binding_cb_t cb, input_binding_cb_
     input_dev.bindings[i].force_ticks = 0;
 }
 
-void udev_mon_handler(void *opaque)
+/* Act on the udev events collected over the last HOTPLUG_DELAY_MS. */
+static void input_hotplug(int fd, short event, void *opaque)
 {
-    struct udev_device *dev;
-    const char *devnode;
-    dev = udev_monitor_receive_device(udev_mon);
-    /* TODO: Make input_scan only consider the added/removed device,
-       for now just trigger a scan for all add events */
-    devnode = udev_device_get_devnode(dev);
-    if (devnode && !strcmp("add", udev_device_get_action(dev)))
-    {
-        fprintf(stderr, "Add device event received for %s\n", devnode);
-        if (strstr(devnode, "event"))
+    struct input_device *dev;
+    struct hotplug *h;
+    unsigned int i;
+
+    for (i = 0; i < hotplug_count; i++)
+    {
+        h = &hotplug_pending[i];
+
+        if ((h->flags & HOTPLUG_REMOVE) && (dev = input_device_by_devnum(h->devnum)))
         {
-            fprintf(stderr, "Initiating scan for %s\n", devnode);
-            input_scan(NULL);
+            info("event%d removed", h->devnum);
+            input_drop_device(dev);
         }
+        if (h->flags & HOTPLUG_ADD)
+            input_probe_device(h->devnum);
+    }
+    hotplug_count = 0;
+}
+
+static bool input_hotplug_queue(const char *action, const char *sysname)
+{
+    struct timeval tv = { 0, HOTPLUG_DELAY_MS * 1000 };
+    struct hotplug *h = NULL;
+    unsigned int i;
+    int devnum;
+
+    if (strcmp(action, "add") && strcmp(action, "remove"))
+        return false;
+    if ((devnum = input_event_devnum(sysname)) < 0)
+        return false;
+
+    for (i = 0; i < hotplug_count; i++)
+        if (hotplug_pending[i].devnum == devnum)
+            h = &hotplug_pending[i];
+    if (!h)
+    {
+        if (hotplug_count == hotplug_size)
+        {
+            h = realloc(hotplug_pending, (hotplug_size + 16) * sizeof(*h));
+            if (!h)
+                return false;
+            hotplug_pending = h;
+            hotplug_size += 16;
+        }
+        h = &hotplug_pending[hotplug_count++];
+        h->devnum = devnum;
+        h->flags = 0;
+    }
+
+    if (!strcmp(action, "add"))
+        h->flags |= HOTPLUG_ADD;
+    else
+        /* Whatever was added before it in this burst is gone again */
+        h->flags = HOTPLUG_REMOVE;
+
+    if (!evtimer_pending(&hotplug_event, NULL))
+        evtimer_add(&hotplug_event, &tv);
+
+    return true;
+}
+
+void udev_mon_handler(void *opaque)
+{
+    struct udev_device *dev;
+    const char *action, *sysname;
+
+    /* Take everything udev has queued, a dock brings a burst of events. */
+    while ((dev = udev_monitor_receive_device(udev_mon)) != NULL)
+    {
+        action = udev_device_get_action(dev);
+        sysname = udev_device_get_sysname(dev);
+        if (action && sysname && udev_device_get_devnode(dev) &&
+            input_hotplug_queue(action, sysname))
+            info("Hotplug %s event received for %s", action, sysname);
+        udev_device_unref(dev);
     }
 }
 
@@ -2949,8 +3813,8 @@ void onstart_sendconfig(struct domain *d)
 
     send_config_reset(d, (uint8_t) 0xFF);
 
-    for (slot = 0; slot < N_DEVS; slot++)
-        if ((input_dev.types[slot] > HID_TYPE_KEYBOARD) && (input_dev.types[slot] < HID_TYPE_THINKPAD_ACPI))
+    for (slot = 0; (unsigned int) slot < input_dev.ndevices; slot++)
+        if ((input_device_type(slot) > HID_TYPE_KEYBOARD) && (input_device_type(slot) < HID_TYPE_THINKPAD_ACPI))
         {
             send_config(d, slot);
         }
@@ -2962,8 +3826,8 @@ void sock_plugin_sendconfig(struct sock_plugin* plug)
     int slot;
     send_plugin_dev_event(plug, DEV_RESET, (uint8_t)0xFF);
 
-    for (slot = 0; slot < N_DEVS; slot++)
-        if ((input_dev.types[slot] > HID_TYPE_KEYBOARD) && (input_dev.types[slot] < HID_TYPE_THINKPAD_ACPI))
+    for (slot = 0; (unsigned int) slot < input_dev.ndevices; slot++)
+        if ((input_device_type(slot) > HID_TYPE_KEYBOARD) && (input_device_type(slot) < HID_TYPE_THINKPAD_ACPI))
         {
             send_plugin_dev_event(plug, DEV_CONF, slot);
         }
@@ -2971,24 +3835,26 @@ void sock_plugin_sendconfig(struct sock_plugin* plug)
 
 void input_release(bool in_fork)
 {
-    int i;
+    struct input_device *dev;
+    unsigned int i;
 
     (void) in_fork;
 
     /* FIXME: For the moment only close file descriptors */
 
-    for (i = 0; i < N_DEVS; i++)
+    for (i = 0; i < input_dev.ndevices; i++)
     {
-        if (input_dev.fds[i] != -1)
+        if ((dev = input_dev.devices[i]) && dev->fd != -1)
         {
-            close(input_dev.fds[i]);
-            input_dev.fds[i] = -1;
+            close(dev->fd);
+            dev->fd = -1;
         }
     }
 
     if (udev)
     {
         event_del(&udev_monitor_event);
+        evtimer_del(&hotplug_event);
         if (udev_mon)
             udev_monitor_unref(udev_mon);
         udev_mon = NULL;
@@ -2997,12 +3863,10 @@ void input_release(bool in_fork)
     udev = NULL;
 }
 
-int input_init(void)
+/* Device independent part of the initialisation, shared with input_bench. */
+static int input_state_init(void)
 {
-    int i;
-    int fd;
-
-    gettimeofday(&global_last_input_event, NULL);
+    monotonic_time(&global_last_input_event);
 
     if (add_domainstart_callback(onstart_sendconfig))
     {
@@ -3011,16 +3875,25 @@ int input_init(void)
     }
 
     memset(&input_dev, 0, sizeof(input_dev));
-    for (i = 0; i < N_DEVS; i++)
-        input_dev.fds[i] = -1;
 
     memset(buttons, 0, sizeof(buttons));
 
     /* Set the mouse to the centre of the screen. */
     mouse_x = (MAX_MOUSE_ABS_X - MIN_MOUSE_ABS_X) / 2;
     mouse_y = (MAX_MOUSE_ABS_Y - MIN_MOUSE_ABS_Y) / 2;
-    compute_mouse_speed();
+    input_settings_reload();
+
+    return 0;
+}
+
+int input_init(void)
+{
+    int fd;
+
+    if (input_state_init())
+        return -1;
 
+    evtimer_set(&hotplug_event, input_hotplug, NULL);
     input_scan(NULL);
 
     /* Create the udev object */
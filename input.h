@@ -17,7 +17,9 @@
  */
 
 typedef int (*input_binding_cb_t)(void *);
-#define N_DEVS              64
+/* Slots reach device models and plugins as a uint8_t, where 0xFF means
+ * "all devices" (config resets), so only 0..254 are usable. */
+#define INPUT_SLOTS_MAX     255
 #define INPUTSLOT_DEFAULT  -1
 #define INPUTSLOT_INVALID  -2
 
@@ -26,6 +28,100 @@ typedef int (*input_binding_cb_t)(void *);
 #define DEV_CONF    0x2
 #define DEV_RESET   0x3
 
+/* libevent priorities: evdev reads and the plugin socket are dispatched
+ * ahead of dbus, xenstore and dmbus control traffic, which stay at
+ * libevent's default priority (EVENT_PRIORITIES / 2, i.e. 1 here). */
+#define EVENT_PRIORITIES        2
+#define EVENT_PRIORITY_INPUT    0
+
+/* Per device state of usb-tablet.c */
+struct tablet_state;
+
+/* Pointer ranges of a touchpad or tablet, normally read from the device
+ * node. input_bench takes them from the capture it replays instead. */
+struct input_ranges
+{
+    struct input_absinfo x;
+    struct input_absinfo y;
+    struct input_absinfo pressure;
+    int clickpad;
+};
+
 #ifndef SYN_DROPPED
 # define SYN_DROPPED 0x3
 #endif
+#ifndef ABS_MT_SLOT
+# define ABS_MT_SLOT 0x2f
+#endif
+#ifndef ABS_MT_PRESSURE
+# define ABS_MT_PRESSURE 0x3a
+#endif
+#ifndef EVIOCGMTSLOTS
+# define EVIOCGMTSLOTS(len) _IOC(_IOC_READ, 'E', 0x0a, len)
+#endif
+
+/* Multitouch contacts looked at when resyncing after SYN_DROPPED */
+#define INPUT_MT_SLOTS          16
+
+/* Events sent to a device model are queued per domain until SYN_REPORT and
+ * handed over as a single dmbus message when the device model advertises
+ * INPUT_CAP_EVENT_BATCH. The message types and capability bits come from
+ * libdmbus; INPUT_CAPS_SUPPORTED is what this build can make use of. */
+#define INPUT_BATCH_MAX         64
+
+#if defined(HAVE_DMBUS_INPUT_EVENT_TS)
+#define INPUT_CAPS_SUPPORTED    (INPUT_CAP_EVENT_BATCH | INPUT_CAP_TIMESTAMPS)
+#elif defined(HAVE_DMBUS_INPUT_EVENT_BATCH)
+#define INPUT_CAPS_SUPPORTED    INPUT_CAP_EVENT_BATCH
+#else
+#define INPUT_CAPS_SUPPORTED    0
+#endif
+
+/* A frame of events waiting for its SYN_REPORT, with their evdev times
+ * and the type of the device they came from (-1 for ones made up), for
+ * latency accounting. Copied into a dmbus message when it is sent, never
+ * sent as is. */
+struct input_batch
+{
+    uint32_t                    count;
+    struct msg_dom0_input_event events[INPUT_BATCH_MAX];
+    struct timeval              times[INPUT_BATCH_MAX];
+    int                         types[INPUT_BATCH_MAX];
+};
+
+/* Input events routed to a domain vs. dmbus messages it took to deliver
+ * them, sampled once a second. */
+struct input_rate
+{
+    struct timeval  since;
+    unsigned int    events;
+    unsigned int    msgs;
+    unsigned int    events_per_sec;
+    unsigned int    msgs_per_sec;
+};
+
+/* Pointer motion held back for a domain that is not keeping up: relative
+ * deltas are summed and absolute axes keep their latest value. MT axes
+ * are never coalesced. */
+struct input_coalesce
+{
+    bool            enabled;
+    bool            pending;
+    bool            synced;
+    int             slot;
+    struct timeval  time;
+    uint32_t        relmask;
+    uint64_t        absmask;
+    int32_t         rel[REL_CNT];
+    int32_t         abs[ABS_MT_SLOT];
+    struct event    retry_event;
+};
+
+/* Where an event leaves the daemon, for latency accounting */
+enum latency_dest
+{
+    LATENCY_DEST_DMBUS = 0,
+    LATENCY_DEST_XENKBD,
+    LATENCY_DEST_PLUGIN,
+    LATENCY_DEST_MAX
+};
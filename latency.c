@@ -0,0 +1,119 @@
+/*
+ * Copyright (c) 2014 Citrix Systems, Inc.
+ * 
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ * 
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "project.h"
+
+/* Delay between the kernel timestamp of an event and the moment it is handed
+ * to its transport, per device type and destination. Buckets are powers of
+ * two of microseconds: <64us, <128us, ... <65ms, and everything above. */
+#define LATENCY_BUCKETS         12
+#define LATENCY_FIRST_SHIFT     6
+
+static const char *latency_dest_names[LATENCY_DEST_MAX] = {
+    [LATENCY_DEST_DMBUS]    = "dmbus",
+    [LATENCY_DEST_XENKBD]   = "xenkbd",
+    [LATENCY_DEST_PLUGIN]   = "plugin",
+};
+
+static const char *latency_type_names[] = {
+    [0]                         = "other",
+    [HID_TYPE_KEYBOARD]         = "keyboard",
+    [HID_TYPE_MOUSE]            = "mouse",
+    [HID_TYPE_TOUCHPAD]         = "touchpad",
+    [HID_TYPE_TABLET]           = "tablet",
+    [HID_TYPE_THINKPAD_ACPI]    = "thinkpad-acpi",
+};
+
+#define LATENCY_TYPES ARRAY_LEN(latency_type_names)
+
+static uint32_t histogram[LATENCY_TYPES][LATENCY_DEST_MAX][LATENCY_BUCKETS];
+
+static struct event dump_event;
+
+void latency_record(int type, enum latency_dest dest, const struct timeval *stamp)
+{
+    struct timeval now;
+    long usec;
+    unsigned int b;
+
+    if (type < 0 || (unsigned int) type >= LATENCY_TYPES)
+        type = 0;
+
+    gettimeofday(&now, NULL);
+    usec = (now.tv_sec - stamp->tv_sec) * 1000000L + (now.tv_usec - stamp->tv_usec);
+    /* Synthesised events may carry no or a bogus timestamp. */
+    if (usec < 0 || usec > 60 * 1000000L)
+        return;
+
+    usec >>= LATENCY_FIRST_SHIFT;
+    for (b = 0; usec && b < LATENCY_BUCKETS - 1; b++)
+        usec >>= 1;
+
+    histogram[type][dest][b]++;
+}
+
+/* One line per device type and destination that saw traffic:
+ * "<type> <dest> <count in bucket 0> ... <count in last bucket>". */
+char *latency_format(void)
+{
+    GString *out = g_string_new("");
+    unsigned int t, d, b;
+
+    for (t = 0; t < LATENCY_TYPES; t++)
+        for (d = 0; d < LATENCY_DEST_MAX; d++)
+        {
+            uint64_t total = 0;
+
+            for (b = 0; b < LATENCY_BUCKETS; b++)
+                total += histogram[t][d][b];
+            if (!total)
+                continue;
+
+            g_string_append_printf(out, "%s %s", latency_type_names[t], latency_dest_names[d]);
+            for (b = 0; b < LATENCY_BUCKETS; b++)
+                g_string_append_printf(out, " %u", histogram[t][d][b]);
+            g_string_append_c(out, '\n');
+        }
+
+    return g_string_free(out, FALSE);
+}
+
+void latency_dump(void)
+{
+    char *text = latency_format();
+    char *line, *save = NULL;
+
+    info("input latency, buckets <%dus doubling up to >=%dms:",
+         1 << LATENCY_FIRST_SHIFT,
+         (1 << (LATENCY_FIRST_SHIFT + LATENCY_BUCKETS - 1)) / 1000);
+    for (line = strtok_r(text, "\n", &save); line; line = strtok_r(NULL, "\n", &save))
+        info("  %s", line);
+
+    g_free(text);
+}
+
+static void wrapper_latency_dump(int sig, short event, void *opaque)
+{
+    latency_dump();
+}
+
+void latency_init(void)
+{
+    signal_set(&dump_event, SIGUSR1, wrapper_latency_dump, NULL);
+    signal_add(&dump_event, NULL);
+}
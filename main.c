@@ -23,6 +23,7 @@ int     main(int argc,char *argv[])
 {
 
     event_init();
+    event_priority_init(EVENT_PRIORITIES);
     bus_init();
     xenstore_init();
     input_init();
@@ -39,6 +40,8 @@ int     main(int argc,char *argv[])
 
     socket_server_init();
 
+    latency_init();
+
     info ("Dispatching events (Event lib v%s. Method %s)",event_get_version (),event_get_method ());
 
     event_dispatch();
@@ -65,6 +65,7 @@ int db_rm(const char *path);
 int db_exists(const char *path);
 int db_read(char *buf, int buf_size, const char *path);
 int db_write(const char *path, const char *value);
+int db_read_async(const char *path, db_read_cb_t cb, void *opaque);
 int Modifers[20];
 int addmod(uint32_t key, uint32_t *mods);
 int check_init_divert_info(struct divert_info_t **dv_in);
@@ -117,6 +118,9 @@ void fixabsbits(uint64_t *bits);
 void fixkeybits(unsigned long *keybits, uint64_t *absbits, int slot);
 int abs_to_rel(struct domain *d, int slot, unsigned long *relbits, uint64_t *absbits);
 int relbits_to_absbits(struct domain *d, unsigned long *relbits, uint64_t *absbits);
+void input_plugin_send(struct domain *d, struct input_event *e);
+void input_plugin_begin(void);
+void input_plugin_end(void);
 void input_domain_gone(struct domain *d);
 void divert_domain_gone(struct divert_info_t *dv, struct domain *d);
 void send_keypair(struct keypairs *key, struct domain *d);
@@ -142,6 +146,7 @@ int input_inject_seamless_mouse(struct input_event *e);
 void input_domain_set_mouse_pos(struct domain *d, int x, int y);
 void input_domain_set_mouse(struct domain *d);
 void input_set_mouse_pos(int x, int y);
+void input_settings_refresh(void);
 int input_get_mouse_speed(void);
 void input_set_mouse_speed(int speed);
 int input_get_numlock_restore_on_switch(void);
@@ -153,12 +158,15 @@ void scale_pointer_event(struct input_event *e);
 void input_inject(struct input_event *e, int slot, enum input_device_type input_type);
 void input_led_code(int led_code, int domid);
 void check_and_inject_event(struct input_event *e, int slot, enum input_device_type input_type);
+void input_process_events(int slot, struct input_event *event, unsigned int n);
 int input_secure(int onoff);
 void input_collect_password(void);
 void input_add_binding(const int tab[], input_binding_cb_t cb, input_binding_cb_t force_cb, void *opaque);
 void udev_mon_handler(void *opaque);
 void onstart_sendconfig(struct domain *d);
 void input_release(_Bool in_fork);
+int input_replay_device(int slot, int fd, enum input_device_type type, const struct input_ranges *ranges);
+int input_replay_init(void);
 int input_init(void);
 void sock_plugin_sendconfig(struct sock_plugin* plug);
 /* domains.c */
@@ -185,6 +193,7 @@ void handle_switcher_leds(void *priv, struct msg_switcher_leds *msg, size_t msgl
 void handle_switcher_shutdown(void *priv, struct msg_switcher_shutdown *msg, size_t msglen);
 void domain_wake_from_s3(struct domain *d);
 void domain_mouse_switch_config(void *opaque);
+void domain_mouse_switch_config_async(struct domain *d);
 struct domain *domain_create(dmbus_client_t client, int domid, DeviceType type);
 struct domain *domain_connect_vkbd(int domid);
 void domains_init(void);
@@ -199,9 +208,12 @@ int domain_set_pvm(struct domain *d, bool is_pvm);
 int domain_attach_vkbd(struct domain *d);
 void domain_detach_vkbd(struct domain *d);
 /* switch.c */
+void switcher_settings_refresh(void);
+int switcher_resistance(void);
 int switcher_switch_graphic(struct domain *d, int force);
 void switcher_unfocus_gpu(void);
 int switcher_switch(struct domain *d, int mouse_switch, int force);
+int switcher_switch_cb(struct domain *d, int mouse_switch, int force, switch_done_cb_t done, void *opaque);
 void switcher_domain_gone(struct domain *d);
 void switcher_s3(struct domain *d);
 int switcher_lock(int can_switch_out);
@@ -214,6 +226,7 @@ void switcher_init(void);
 /* util.c */
 void helper_exec(const char *bin, int domid);
 void message(int flags, const char *file, const char *function, int line, const char *fmt, ...);
+void monotonic_time(struct timeval *tv);
 void log_dbus_error(const char *file, const char *function, int line, const char *err, const char *fmt, ...);
 /* focus.c */
 void focus_expect_death(struct domain *d);
@@ -227,8 +240,10 @@ int touchpad_get_speed(void);
 void touchpad_set_scrolling_enabled(int enabled);
 void touchpad_set_tap_to_click_enabled(int enabled);
 void touchpad_set_speed(int speed);
+void touchpad_resync(void);
 void handle_touchpad_event(struct input_event *ev, int slot);
 void toggle_touchpad_status(void);
+int init_touchpad_ranges(const struct input_ranges *r);
 int init_touchpad(int fd);
 void touchpad_reread_config(void);
 /* keymap.c */
@@ -238,8 +253,9 @@ int loadkeys(const char *keymap);
 void keymap_init(void);
 /* usb-tablet.c */
 void set_and_inject_event(int slot, struct input_event *ev, int type, int code, int value);
-void handle_usb_tablet_event(struct input_event *ev, int slot);
-int init_usb_tablet(int fd, int slot, uint8_t subtype);
+void handle_usb_tablet_event(struct input_event *ev, int slot, struct tablet_state *t);
+struct tablet_state *init_usb_tablet_ranges(const struct input_absinfo *absinfo_x, const struct input_absinfo *absinfo_y, uint8_t subtype);
+struct tablet_state *init_usb_tablet(int fd, uint8_t subtype);
 /* rpcgen/input_daemon_server_obj.c */
 void dbus_glib_marshal_input_daemon_BOOLEAN__STRING_STRING_INT_POINTER(GClosure *closure, GValue *return_value, guint n_param_values, const GValue *param_values, gpointer invocation_hint, gpointer marshal_data);
 void dbus_glib_marshal_input_daemon_BOOLEAN__INT_POINTER(GClosure *closure, GValue *return_value, guint n_param_values, const GValue *param_values, gpointer invocation_hint, gpointer marshal_data);
@@ -266,13 +282,16 @@ InputDaemonObject *input_daemon_export_dbus(DBusGConnection *conn, const char *p
 int host_pmop_in_progress(void);
 void pm_init(void);
 /* xen_vkbd.c */
-void xen_vkbd_send_event(struct domain *d, struct input_event *event);
+void xen_vkbd_send_event(struct domain *d, struct input_event *event, int type);
 void xen_vkbd_backend_create(struct domain *d);
 void xen_vkbd_backend_release(struct domain *d);
 void xen_backend_init(int dom0);
 void xen_backend_close(void);
 /* xen_event.c */
-void xen_event_send(struct xen_vkbd_backend *backend, uint16_t type, uint16_t code, int32_t value);
+void xen_event_flush(struct xen_vkbd_backend *backend);
+_Bool xen_event_busy(struct xen_vkbd_backend *backend);
+void xen_event_stats(struct xen_vkbd_backend *backend, unsigned long *merged, unsigned long *dropped);
+void xen_event_send(struct xen_vkbd_backend *backend, uint16_t type, uint16_t code, int32_t value, const struct xen_event_stamp *stamp);
 /* gesture.c */
 int position_match(gesture_position a, int x, int y);
 int gesture_match(gesture *g, int slot, int x, int y, int push, int *tracking);
@@ -294,5 +313,15 @@ struct domain *get_keyb_dest(void);
 /* socket.c */
 void socket_server_init(void);
 void socket_server_close(void);
-void send_plugin_event(struct domain *d,int slot, struct input_event *e);
+void socket_domain_gone(struct domain *d);
+int socket_plugin_busy(struct domain *d);
+int send_to_plugin(struct sock_plugin* plug,struct event_record* e);
+void socket_plugin_flush(struct domain *d);
 void send_plugin_dev_event(struct sock_plugin* plug, int code, int value);
+void send_plugin_dev_events(struct domain *d, int code, int value);
+void send_plugin_event(struct domain *d, int slot, struct input_event *e, int type);
+/* latency.c */
+void latency_record(int type, enum latency_dest dest, const struct timeval *stamp);
+char *latency_format(void);
+void latency_dump(void);
+void latency_init(void);
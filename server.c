@@ -21,6 +21,9 @@
 extern void handle_switcher_abs(void *priv, struct msg_switcher_abs *msg, size_t msglen);
 extern void handle_switcher_leds(void *priv, struct msg_switcher_leds *msg, size_t msglen);
 extern void handle_switcher_shutdown(void *priv, struct msg_switcher_shutdown *msg, size_t msglen);
+#ifdef HAVE_DMBUS_INPUT_EVENT_BATCH
+extern void handle_input_caps(void *priv, struct msg_input_caps *msg, size_t msglen);
+#endif
 
 void server_kill_domain(struct domain *d)
 {
@@ -32,7 +35,10 @@ void server_kill_domain(struct domain *d)
 static struct dmbus_rpc_ops input_rpc_ops = {
   .switcher_abs = handle_switcher_abs,
   .switcher_leds = handle_switcher_leds,
-  .switcher_shutdown = handle_switcher_shutdown
+  .switcher_shutdown = handle_switcher_shutdown,
+#ifdef HAVE_DMBUS_INPUT_EVENT_BATCH
+  .input_caps = handle_input_caps,
+#endif
 };
 
 static struct event rpc_connect_event;
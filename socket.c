@@ -17,6 +17,24 @@
  */
 
 #include "project.h"
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+
+#ifndef MFD_CLOEXEC
+# define MFD_CLOEXEC        0x0001U
+#endif
+#ifndef MFD_ALLOW_SEALING
+# define MFD_ALLOW_SEALING  0x0002U
+#endif
+#ifndef F_ADD_SEALS
+# define F_ADD_SEALS        (1024 + 9)
+#endif
+#ifndef F_SEAL_SHRINK
+# define F_SEAL_SHRINK      0x0002
+#endif
+#ifndef F_SEAL_GROW
+# define F_SEAL_GROW        0x0004
+#endif
 
 #define MAGIC 0xAD9CBCE9
 
@@ -26,68 +44,137 @@
 #define VM_SEND_TO      0x1
 #define VM_TAKE_FROM    0x2
 #define VM_ERROR        0x3
-struct sock_plugin buffers;
+#define VM_SHM          0x4
+#define VM_HELLO        0x5
+#define VM_ACK          0x6
 
 static struct event server_accept_event;
 static long server_sock_fd;
 
+/* What to give up when a plugin's send queue is full */
+enum plugin_overflow
+{
+    PLUGIN_OVERFLOW_DROP_MOTION,    /* oldest queued motion */
+    PLUGIN_OVERFLOW_DROP_NEW,       /* the record being queued */
+};
+static enum plugin_overflow plugin_overflow = PLUGIN_OVERFLOW_DROP_MOTION;
+
+/* Connection table, one entry per connected plugin. */
+static struct sock_plugin** plugins;
+static unsigned int nplugins;
+
 static void process_event(struct event_record* r, struct sock_plugin* b);
+static int flush_to_plugin(struct sock_plugin* plug);
+static int frame_window_full(struct sock_plugin* plug);
 void send_event(struct sock_plugin* plug, int t, int c, int v);
 void kill_connection(struct sock_plugin* buf);
 int send_to_plugin(struct sock_plugin* plug,struct event_record* e);
 
-struct event_record* findnext(struct sock_plugin* b)
+#define RECV_MASK (PLUGIN_RECV_LEN - 1)
+
+// copies len bytes, starting off bytes into the receive ring, out to dst
+static void recv_copy(struct sock_plugin* b, unsigned int off, void* dst, unsigned int len)
 {
-struct event_record* r =  NULL;
-int start=b->position;
-// Skip junk
-while (b->bytes_remaining >= EVENT_SIZE &&
-      (r = (struct event_record*) &b->buffer[b->position]) &&
-       r->magic != MAGIC)
-   {
-   b->bytes_remaining--;
-   b->position++;
-   }
+    unsigned int start = (b->recv_head + off) & RECV_MASK;
+    unsigned int first = PLUGIN_RECV_LEN - start;
 
-if (start!=b->position)
-    info("Warning: Encountered %d bytes of junk.\n", b->position - start);
+    if (first > len)
+        first = len;
+    memcpy(dst, &b->buffer[start], first);
+    memcpy((char*) dst + first, b->buffer, len - first);
+}
 
-if (b->bytes_remaining >= EVENT_SIZE)
-    {
-	b->bytes_remaining-= EVENT_SIZE;
-	b->position+=EVENT_SIZE;
-	return r;
-    }
-    else
-       return NULL;
+static void recv_consume(struct sock_plugin* b, unsigned int len)
+{
+    b->recv_head = (b->recv_head + len) & RECV_MASK;
+    b->recv_count -= len;
 }
 
-struct event server_recv_event;
+// Takes the next record off the receive ring, skipping junk. The record is
+// copied out to r, so it may straddle the end of the ring and need not be
+// aligned.
+static int findnext(struct sock_plugin* b, struct event_record* r)
+{
+    static const uint32_t magic = MAGIC;
+    unsigned char first = *(const unsigned char*) &magic;
+    unsigned int junk = 0;
+    unsigned int len, skip;
+    char* p;
+    int found = 0;
+
+    while (b->recv_count >= EVENT_SIZE)
+        {
+        recv_copy(b, 0, r, EVENT_SIZE);
+        if (r->magic == MAGIC)
+            {
+            recv_consume(b, EVENT_SIZE);
+            b->recv_records++;
+            found = 1;
+            break;
+            }
+
+        // Out of step: jump to the next byte that could start a MAGIC,
+        // rather than retrying at every offset.
+        len = PLUGIN_RECV_LEN - b->recv_head;
+        if (len > b->recv_count)
+            len = b->recv_count;
+        p = memchr(&b->buffer[b->recv_head + 1], first, len - 1);
+        skip = p ? (unsigned int) (p - &b->buffer[b->recv_head]) : len;
+        recv_consume(b, skip);
+        junk += skip;
+        }
+
+    if (junk)
+        {
+        b->recv_junk += junk;
+        info("Warning: Encountered %u bytes of junk.\n", junk);
+        }
+    return found;
+}
 
 static void wrapper_server_recv(int fd, short event, void *opaque)
 {
-int n;
 struct sock_plugin* buf = (struct sock_plugin*) opaque;
-char *b = buf->buffer;
-
-memmove(b, &b[buf->position] , buf->bytes_remaining);
-buf->position=0;
+struct event_record r;
+struct iovec iov[2];
+struct msghdr msg;
+unsigned int tail, space;
+ssize_t n;
+
+// Whole records were all taken off on the last pass, so nearly all of the
+// ring is free: read into it in one go, wrapping with a second iovec.
+tail = (buf->recv_head + buf->recv_count) & RECV_MASK;
+space = PLUGIN_RECV_LEN - buf->recv_count;
+iov[0].iov_base = &buf->buffer[tail];
+iov[0].iov_len = PLUGIN_RECV_LEN - tail;
+if (iov[0].iov_len > space)
+    iov[0].iov_len = space;
+iov[1].iov_base = buf->buffer;
+iov[1].iov_len = space - iov[0].iov_len;
+
+memset(&msg, 0, sizeof(msg));
+msg.msg_iov = iov;
+msg.msg_iovlen = iov[1].iov_len ? 2 : 1;
 do
 {
-    n=recv(fd, &b[buf->bytes_remaining], buffersize- buf->bytes_remaining,0);
+    n=recvmsg(fd, &msg, MSG_DONTWAIT);
 } 
 while ((n<0) && (errno==EINTR));
 
 if (n>0)
 	{
-	struct event_record* r =  NULL;
-	buf->bytes_remaining+=n;
+	buf->recv_count+=n;
+	buf->recv_bytes+=n;
 
-	while ((r=findnext(buf))!=NULL)
+	input_plugin_begin();
+	while ((buf->s != -1) && findnext(buf, &r))
            {
-           process_event(r,buf);
+           process_event(&r,buf);
            }
+	input_plugin_end();
 	}
+else if (n && (errno == EAGAIN || errno == EWOULDBLOCK))
+    return;
 else if (n)
 {
     info("Recv failed with %s",strerror(errno));
@@ -100,18 +187,99 @@ else
     }
 }
 
+static void plugin_unlink(struct sock_plugin* plug)
+{
+    struct sock_plugin** p;
+
+    /* plug->next is left alone, a caller may be walking the list. */
+    for (p = &plug->src->plugin; *p; p = &(*p)->next)
+        if (*p == plug)
+            {
+            *p = plug->next;
+            break;
+            }
+    plug->src = NULL;
+}
+
+static void plugin_free(int fd, short event, void *opaque)
+{
+    free(opaque);
+}
+
 void kill_connection(struct sock_plugin* buf)
 {
-    event_del(&server_recv_event);
+    struct timeval tv = { 0, 0 };
+    unsigned int i;
+
+    if (buf->s == -1)
+        return;
+
+    event_del(&buf->recv_event);
+    if (buf->send_pending)
+        event_del(&buf->send_event);
     close(buf->s);
 
-    if (buf->src)
+    info("Plugin connection closed: %lu sends, %lu records dropped on overflow",
+         buf->sends, buf->overflows);
+    info("Plugin connection received %lu bytes, %lu records, %lu bytes of junk",
+         buf->recv_bytes, buf->recv_records, buf->recv_junk);
+
+    if (buf->shm)
         {
-        buf->src->plugin=NULL;
-        buf->src=NULL;
+        munmap(buf->shm, buf->shm_len);
+        close(buf->shm_efd);
+        buf->shm=NULL;
         }
+
+    if (buf->src)
+        plugin_unlink(buf);
+    buf->dest=NULL;
     buf->s=-1;
     free(buf->dev_events);
+    buf->dev_events=NULL;
+    buf->deq_size=0;
+
+    for (i = 0; i < nplugins; i++)
+        if (plugins[i] == buf)
+            {
+            plugins[i] = plugins[--nplugins];
+            break;
+            }
+
+    /* We may be deep in a send or a recv on this connection, free it from the loop. */
+    event_once(-1, EV_TIMEOUT, plugin_free, buf, &tv);
+}
+
+// called from input.c when a domain goes away.
+
+void socket_domain_gone(struct domain *d)
+{
+    unsigned int i;
+
+    for (i = 0; i < nplugins; i++)
+        {
+        if (plugins[i]->src == d)
+            plugin_unlink(plugins[i]);
+        if (plugins[i]->dest == d)
+            plugins[i]->dest = NULL;
+        }
+}
+
+// Whether any plugin taking from d is behind: waiting for its socket to
+// drain, or with its shared ring over half full.
+
+int socket_plugin_busy(struct domain *d)
+{
+    struct sock_plugin* plug;
+
+    for (plug = d->plugin; plug; plug = plug->next)
+        {
+        if (plug->send_pending || frame_window_full(plug))
+            return true;
+        if (plug->shm && (plug->shm->head - plug->shm->tail > INPUT_SHM_RING_LEN / 2))
+            return true;
+        }
+    return false;
 }
 
 #define E_BADDOMAIN 0x1
@@ -320,85 +488,604 @@ else if (plug->resetall)
 }
 
 
-// send_delayed_to_plugin - calledfrom send_to_plugin
-// sends remaining of partial sends.
+void send_plugin_dev_events(struct domain *d, int code, int value)
+{
+struct sock_plugin* plug;
 
-static int send_delayed_to_plugin(struct sock_plugin* plug)
+for (plug = d->plugin; plug; plug = plug->next)
+    send_plugin_dev_event(plug, code, value);
+}
+
+
+static int record_is_motion(const struct event_record* r)
 {
-int r;
-do
-    {
-    r = send(plug->s, plug->partialBuffer, plug->delayed, MSG_NOSIGNAL | MSG_DONTWAIT);
+    return (r->itype == EV_REL) || (r->itype == EV_ABS);
+}
+
+// Input records wait for the end of their frame, anything else goes out now.
+
+static int record_is_input(const struct event_record* r)
+{
+    return record_is_motion(r) || (r->itype == EV_KEY) || (r->itype == EV_MSC);
+}
 
-    if (r>0)
+// Latency of input records is taken once they left: when the socket took
+// their last byte, or when the plugin was signalled about the shm ring.
+
+static struct plugin_latency* plugin_latency_at(struct sock_plugin* plug, unsigned int i)
+{
+    return &plug->lat[(plug->lat_head + i) % PLUGIN_LATENCY_LEN];
+}
+
+static void plugin_latency_queue(struct sock_plugin* plug, uint64_t end)
+{
+    struct plugin_latency* l;
+
+    if (!timerisset(&plug->stamp) || (plug->stamp_type < 0) ||
+        (plug->lat_count == PLUGIN_LATENCY_LEN))
+        return;
+
+    l = plugin_latency_at(plug, plug->lat_count++);
+    l->time = plug->stamp;
+    l->type = plug->stamp_type;
+    l->end = end;
+}
+
+static void plugin_latency_sent(struct sock_plugin* plug, bool all)
+{
+    struct plugin_latency* l;
+
+    while (plug->lat_count)
         {
-        plug->delayed-=r;
-        if (plug->delayed)
-            memmove(&plug->partialBuffer, ((char*) ( &plug->partialBuffer)) + r, plug->delayed);
+        l = plugin_latency_at(plug, 0);
+        if (!all && (!l->end || (l->end > plug->lat_sent)))
+            break;
+        latency_record(l->type, LATENCY_DEST_PLUGIN, &l->time);
+        plug->lat_head = (plug->lat_head + 1) % PLUGIN_LATENCY_LEN;
+        plug->lat_count--;
         }
-    }
-while ( ((r==-1) && (errno==EINTR)) || ((r>0) && (plug->delayed)) );
+}
 
+// Forgets the samples of the stream bytes (lo, hi] that were given up,
+// with 0 meaning the open frame.  Later samples move down.
 
-if (r==-1) 
+static void plugin_latency_drop(struct sock_plugin* plug, uint64_t lo, uint64_t hi)
 {
-    if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
+    struct plugin_latency* l;
+    unsigned int i, n = 0;
+
+    for (i = 0; i < plug->lat_count; i++)
         {
-        info(strerror(errno));
-        kill_connection(plug);
+        l = plugin_latency_at(plug, i);
+        if (hi ? ((l->end > lo) && (l->end <= hi)) : !l->end)
+            continue;
+        if (hi && (l->end > hi))
+            l->end -= hi - lo;
+        *plugin_latency_at(plug, n++) = *l;
         }
-    return false;
+    plug->lat_count = n;
+    plug->lat_queued -= hi - lo;
 }
 
-return true;
+// The open frame was queued, its samples end with it.
+
+static void plugin_latency_frame(struct sock_plugin* plug)
+{
+    unsigned int i;
+
+    for (i = 0; i < plug->lat_count; i++)
+        if (!plugin_latency_at(plug, i)->end)
+            plugin_latency_at(plug, i)->end = plug->lat_queued;
+}
+
+static void wrapper_server_send(int fd, short event, void *opaque)
+{
+    struct sock_plugin* plug = (struct sock_plugin*) opaque;
+
+    plug->send_pending = false;
+    flush_to_plugin(plug);
+}
+
+static void wait_writable(struct sock_plugin* plug)
+{
+    if (!plug->send_pending)
+        {
+        event_add(&plug->send_event, NULL);
+        plug->send_pending = true;
+        }
+}
+
+// writes out as much of the send queue as the socket takes, one sendmsg per
+// contiguous run.  Waits for EV_WRITE when the socket is full.
+
+static int flush_sendq(struct sock_plugin* plug)
+{
+    struct iovec iov[2];
+    struct msghdr msg;
+    unsigned int head, n;
+    ssize_t r;
+
+    while (plug->sendq_count)
+        {
+        head = plug->sendq_head;
+        n = PLUGIN_SENDQ_LEN - head;
+        if (n > plug->sendq_count)
+            n = plug->sendq_count;
+
+        iov[0].iov_base = (char*) &plug->sendq[head] + plug->sendq_offset;
+        iov[0].iov_len = n * EVENT_SIZE - plug->sendq_offset;
+        iov[1].iov_base = plug->sendq;
+        iov[1].iov_len = (plug->sendq_count - n) * EVENT_SIZE;
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iov[1].iov_len ? 2 : 1;
+
+        do
+            {
+            r = sendmsg(plug->s, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+            }
+        while ((r==-1) && (errno==EINTR));
+
+        if (r==-1)
+            {
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+                wait_writable(plug);
+            else
+                {
+                info(strerror(errno));
+                kill_connection(plug);
+                }
+            return false;
+            }
+
+        plug->sends++;
+        plug->lat_sent += r;
+        plugin_latency_sent(plug, false);
+        r += plug->sendq_offset;
+        plug->sendq_head = (head + r / EVENT_SIZE) % PLUGIN_SENDQ_LEN;
+        plug->sendq_count -= r / EVENT_SIZE;
+        plug->sendq_offset = r % EVENT_SIZE;
+        }
+    return true;
+}
+
+// writes out encoded v2 frames.
+
+static int flush_out(struct sock_plugin* plug)
+{
+    ssize_t r;
+
+    while (plug->out_off < plug->out_len)
+        {
+        do
+            {
+            r = send(plug->s, plug->out + plug->out_off, plug->out_len - plug->out_off,
+                     MSG_NOSIGNAL | MSG_DONTWAIT);
+            }
+        while ((r==-1) && (errno==EINTR));
+
+        if (r==-1)
+            {
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+                wait_writable(plug);
+            else
+                {
+                info(strerror(errno));
+                kill_connection(plug);
+                }
+            return false;
+            }
+        plug->sends++;
+        plug->out_off += r;
+        plug->lat_sent += r;
+        plugin_latency_sent(plug, false);
+        }
+    plug->out_off = plug->out_len = 0;
+    return true;
+}
+
+// v1 records left from before the switch to v2 go out first.
+
+static int flush_to_plugin(struct sock_plugin* plug)
+{
+    if (!flush_sendq(plug))
+        return false;
+    return flush_out(plug);
+}
+
+// v2 framing, see xc_input_socket_protocol.h.
+
+static int frame_window_full(struct sock_plugin* plug)
+{
+    return (plug->caps & INPUT_PROTO_CAP_ACK) &&
+        (plug->frame_seq - plug->frame_acked >= INPUT_PROTO_ACK_WINDOW);
+}
+
+// Encodes the pending frame into the out buffer.  Frames of plain motion are
+// given up when the plugin is behind; losing anything else means SYN_DROPPED.
+
+static void frame_close(struct sock_plugin* plug)
+{
+    struct input_frame_header h;
+    unsigned int len = plug->frame_count * sizeof(struct input_frame_event);
+
+    if (!plug->frame_count)
+        return;
+
+    if (plug->out_len + sizeof(h) + len > PLUGIN_OUT_LEN && plug->out_off)
+        {
+        memmove(plug->out, plug->out + plug->out_off, plug->out_len - plug->out_off);
+        plug->out_len -= plug->out_off;
+        plug->out_off = 0;
+        }
+
+    if (!plug->frame_keep && (frame_window_full(plug) ||
+                              (plug->out_len + sizeof(h) + len > PLUGIN_OUT_LEN / 2)))
+        {
+        plug->overflows += plug->frame_count;
+        plug->frame_count = 0;
+        plugin_latency_drop(plug, 0, 0);
+        return;
+        }
+
+    if (plug->out_len + sizeof(h) + len > PLUGIN_OUT_LEN)
+        {
+        plug->overflows += plug->frame_count;
+        plug->frame_count = 0;
+        plug->frame_keep = false;
+        plug->dropped = true;
+        plugin_latency_drop(plug, 0, 0);
+        return;
+        }
+
+    h.magic = INPUT_FRAME_MAGIC;
+    h.version = INPUT_PROTO_V2;
+    h.count = plug->frame_count;
+    h.seq = ++plug->frame_seq;
+    h.len = len;
+
+    memcpy(plug->out + plug->out_len, &h, sizeof(h));
+    memcpy(plug->out + plug->out_len + sizeof(h), plug->frame, len);
+    plug->out_len += sizeof(h) + len;
+    plug->lat_queued += sizeof(h) + len;
+    plugin_latency_frame(plug);
+
+    plug->frame_count = 0;
+    plug->frame_keep = false;
+}
+
+static int frame_ends(const struct event_record* e)
+{
+    return (e->itype == EV_SYN) || (e->itype == EV_VM) ||
+        ((e->itype == EV_DEV) && (e->icode != DEV_SET));
+}
+
+static void frame_add(struct sock_plugin* plug, struct event_record* e)
+{
+    struct input_frame_event* fe;
+
+    if (plug->frame_count == INPUT_FRAME_MAX)
+        frame_close(plug);
+
+    fe = &plug->frame[plug->frame_count++];
+    if (plug->caps & INPUT_PROTO_CAP_TIMESTAMPS)
+        {
+        fe->sec = plug->stamp.tv_sec;
+        fe->usec = plug->stamp.tv_usec;
+        }
+    else
+        fe->sec = fe->usec = 0;
+    fe->type = e->itype;
+    fe->code = e->icode;
+    fe->value = e->ivalue;
+    plugin_latency_queue(plug, 0);
+
+    if (!record_is_motion(e) && !((e->itype == EV_SYN) && (e->icode == SYN_REPORT)))
+        plug->frame_keep = true;
+
+    if (frame_ends(e))
+        {
+        frame_close(plug);
+        flush_to_plugin(plug);
+        }
+}
+
+// VM_HELLO from the plugin.  The answer is the last v1 record it gets.
+
+static void plugin_hello(struct sock_plugin* plug, uint32_t hello)
+{
+    struct event_record er;
+    int version = INPUT_PROTO_HELLO_VERSION(hello);
+    uint32_t caps = INPUT_PROTO_HELLO_CAPS(hello);
+
+    if (version >= INPUT_PROTO_V2 && plug->version < INPUT_PROTO_V2)
+        {
+        version = INPUT_PROTO_V2;
+        caps &= INPUT_PROTO_CAP_TIMESTAMPS | INPUT_PROTO_CAP_ACK;
+        }
+    else
+        {
+        version = plug->version;
+        caps = plug->caps;
+        }
+
+    er.magic = MAGIC;
+    er.itype = EV_VM;
+    er.icode = VM_HELLO;
+    er.ivalue = INPUT_PROTO_HELLO(version, caps);
+    if (!send_to_plugin(plug, &er))
+        {
+        send_error(plug, E_BADCODE, VM_HELLO, 0);
+        return;
+        }
+
+    if (version != plug->version)
+        info("Plugin speaks protocol v%d (caps %#x)", version, caps);
+    plug->version = version;
+    plug->caps = caps;
+    plug->frame_seq = plug->frame_acked = 0;
+}
+
+// Shared memory transport, see xc_input_socket_protocol.h.
+
+static int shm_push(struct sock_plugin* plug, struct event_record* e)
+{
+    struct input_shm_ring* ring = plug->shm;
+    struct event_record* records = (struct event_record*) (ring + 1);
+    uint32_t head = ring->head;
+
+    if (head - ring->tail >= INPUT_SHM_RING_LEN)
+        {
+        ring->dropped++;
+        return false;
+        }
+
+    records[head & (INPUT_SHM_RING_LEN - 1)] = *e;
+    __sync_synchronize();
+    ring->head = head + 1;
+    plug->shm_unsignalled++;
+    return true;
+}
+
+static void shm_signal(struct sock_plugin* plug)
+{
+    uint64_t one = 1;
+
+    if (!plug->shm_unsignalled)
+        return;
+    if (write(plug->shm_efd, &one, sizeof(one)) == sizeof(one))
+        plug->sends++;
+    plug->shm_unsignalled = 0;
+    plugin_latency_sent(plug, true);
+}
+
+static int memfd_open(const char *name)
+{
+#ifdef __NR_memfd_create
+    return syscall(__NR_memfd_create, name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
 }
 
-// sends raw event to plugin.  Partial sends are delt with.
+// Sets up the ring and hands it to the plugin.  Whatever is still queued
+// on the socket has to go first, so that the plugin sees records in order.
+
+static int plugin_shm_setup(struct sock_plugin* plug)
+{
+    size_t len = sizeof(struct input_shm_ring) + INPUT_SHM_RING_LEN * EVENT_SIZE;
+    char cbuf[CMSG_SPACE(2 * sizeof(int))];
+    struct event_record er;
+    struct input_shm_ring* ring;
+    struct cmsghdr* cmsg;
+    struct msghdr msg;
+    struct iovec iov;
+    int memfd, efd, fds[2];
+    ssize_t r;
+
+    if (!flush_to_plugin(plug))
+        return false;
+
+    if ((memfd = memfd_open("input_shm")) < 0)
+        {
+        info("memfd_create failed with %s", strerror(errno));
+        return false;
+        }
+    if (ftruncate(memfd, len) ||
+        (ring = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0)) == MAP_FAILED)
+        {
+        info("Unable to map the plugin ring: %s", strerror(errno));
+        close(memfd);
+        return false;
+        }
+    // The plugin maps the same size; stop either side resizing it under
+    // the other (a shrink would SIGBUS whoever touches the tail).
+    if (fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW))
+        {
+        info("Unable to seal the plugin ring: %s", strerror(errno));
+        munmap(ring, len);
+        close(memfd);
+        return false;
+        }
+    if ((efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+        {
+        info("eventfd failed with %s", strerror(errno));
+        munmap(ring, len);
+        close(memfd);
+        return false;
+        }
+
+    memset(ring, 0, len);
+    ring->size = INPUT_SHM_RING_LEN;
+
+    er.magic = MAGIC;
+    er.itype = EV_VM;
+    er.icode = VM_SHM;
+    er.ivalue = INPUT_SHM_RING_LEN;
+
+    iov.iov_base = &er;
+    iov.iov_len = EVENT_SIZE;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+
+    fds[0] = memfd;
+    fds[1] = efd;
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    do
+        {
+        r = sendmsg(plug->s, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        }
+    while ((r==-1) && (errno==EINTR));
+
+    close(memfd);
+    if (r != (ssize_t) EVENT_SIZE)
+        {
+        munmap(ring, len);
+        close(efd);
+        /* Half a record on the wire leaves the stream out of sync. */
+        if (r > 0)
+            kill_connection(plug);
+        return false;
+        }
+
+    plug->shm = ring;
+    plug->shm_len = len;
+    plug->shm_efd = efd;
+    plug->shm_unsignalled = 0;
+    info("Plugin switched to a %u record shared memory ring", INPUT_SHM_RING_LEN);
+    return true;
+}
+
+static struct event_record* sendq_at(struct sock_plugin* plug, unsigned int i)
+{
+    return &plug->sendq[(plug->sendq_head + i) % PLUGIN_SENDQ_LEN];
+}
+
+static int record_is_syn(const struct event_record* r)
+{
+    return (r->itype == EV_SYN) && (r->icode == SYN_REPORT);
+}
+
+// Makes room for one more record in a full queue.  Only a whole motion
+// frame is given up, oldest first, together with its SYN_REPORT so that
+// REL_X never goes without its REL_Y.  Frames holding key edges and
+// control records are never dropped here.
+
+static int sendq_make_room(struct sock_plugin* plug)
+{
+    unsigned int i, start, end, n;
+
+    if (plug->sendq_count < PLUGIN_SENDQ_LEN)
+        return true;
+    if (plugin_overflow == PLUGIN_OVERFLOW_DROP_NEW)
+        return false;
+
+    /* The head may be the tail end of a partly sent frame, so frames are
+       only known to start after a queued SYN_REPORT. */
+    for (i = 0; i < plug->sendq_count; i++)
+        if (record_is_syn(sendq_at(plug, i)))
+            break;
+
+    for (start = i + 1; start < plug->sendq_count; start = end + 1)
+        {
+        for (end = start; end < plug->sendq_count; end++)
+            if (!record_is_motion(sendq_at(plug, end)))
+                break;
+        if (end == plug->sendq_count)
+            return false;
+        if ((end > start) && record_is_syn(sendq_at(plug, end)))
+            break;
+        while ((end < plug->sendq_count) && !record_is_syn(sendq_at(plug, end)))
+            end++;
+        }
+    if (start >= plug->sendq_count)
+        return false;
+
+    n = end + 1 - start;
+    for (i = start; i + n < plug->sendq_count; i++)
+        *sendq_at(plug, i) = *sendq_at(plug, i + n);
+    plug->sendq_count -= n;
+    plug->overflows++;
+    /* The queue is the front of what the socket still has to take. */
+    plugin_latency_drop(plug, plug->lat_sent - plug->sendq_offset + start * EVENT_SIZE,
+                        plug->lat_sent - plug->sendq_offset + (start + n) * EVENT_SIZE);
+    return true;
+}
+
+// queues a raw event for the plugin.  Returns false when the event was lost,
+// the caller then owes the plugin a SYN_DROPPED.
 
 int send_to_plugin(struct sock_plugin* plug,struct event_record* e)
 {
-int r;
-if (plug->delayed)
+if (plug->s == -1)
+    return false;
+
+if (plug->shm)
     {
-    r = send_delayed_to_plugin(plug);
-    if (!r)
+    if (!shm_push(plug, e))
         {
+        plug->overflows++;
         return false;
         }
+    plugin_latency_queue(plug, 0);
+    if (!record_is_input(e))
+        shm_signal(plug);
+    return true;
     }
-do
+
+if (plug->version >= INPUT_PROTO_V2)
     {
-    r = send(plug->s, e, sizeof(struct event_record), MSG_NOSIGNAL | MSG_DONTWAIT);
+    frame_add(plug, e);
+    return true;
     }
-while ((r==-1) && (errno==EINTR));
 
-if (r==-1)
+if (!sendq_make_room(plug))
     {
-    if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+    plug->overflows++;
+    return false;
+    }
+
+plug->sendq[(plug->sendq_head + plug->sendq_count++) % PLUGIN_SENDQ_LEN] = *e;
+plug->lat_queued += EVENT_SIZE;
+plugin_latency_queue(plug, plug->lat_queued);
+
+if (!record_is_input(e) || (plug->sendq_count >= PLUGIN_SENDQ_LEN / 2))
+    flush_to_plugin(plug);
+return true;
+}
+
+// called from input.c at the end of a device read.
+
+void socket_plugin_flush(struct domain *d)
+{
+struct sock_plugin* plug;
+
+for (plug = d->plugin; plug; plug = plug->next)
+    if (plug->shm)
+        shm_signal(plug);
+    else
         {
-         // PACKET LOST;
-        return false;
+        frame_close(plug);
+        if (!plug->send_pending)
+            flush_to_plugin(plug);
         }
-     else
-         {
-         info(strerror(errno));
-         kill_connection(plug);
-         }
-    } 
-else if (r< (int) sizeof(struct event_record)) // partial send
-    {
-    plug->delayed=sizeof(struct event_record) - r;
-    memcpy(&plug->partialBuffer, ((char*)e) + r , plug->delayed);
-    send_delayed_to_plugin(plug);
-    }
-    return true;
 }
 
-// sends an event, on the given slot, to the plugin
+// sends an encoded event, on the given slot, to one plugin
 
-void send_plugin_event(struct domain *d,int slot, struct input_event *e)
+static void send_plugin_record(struct sock_plugin* plug, int slot, struct event_record* ev,
+                               const struct timeval* stamp, int type)
 {
-struct sock_plugin* plug=d->plugin;
 struct event_record er;
 
 er.magic= MAGIC;
@@ -441,15 +1128,13 @@ if (plug->dropped)
             return;
     }
 
-er.itype=e->type;
-er.icode=e->code;
-er.ivalue=e->value;
-
-
-if (!send_to_plugin(plug, &er))
+plug->stamp = *stamp;
+plug->stamp_type = type;
+if (!send_to_plugin(plug, ev))
     {
     plug->dropped=true;
     }
+timerclear(&plug->stamp);
 return;
 
 cantsend:
@@ -461,6 +1146,23 @@ cantsend:
     return;
 }
 
+// sends an event, on the given slot, to every plugin taking from d.
+// The record is encoded once and shared by all of them.
+
+void send_plugin_event(struct domain *d, int slot, struct input_event *e, int type)
+{
+struct sock_plugin* plug;
+struct event_record er;
+
+er.magic= MAGIC;
+er.itype=e->type;
+er.icode=e->code;
+er.ivalue=e->value;
+
+for (plug = d->plugin; plug; plug = plug->next)
+    send_plugin_record(plug, slot, &er, &e->time, type);
+}
+
 static void process_event(struct event_record* r, struct sock_plugin* plug)
 {
   if (r->itype == EV_VM)
@@ -473,11 +1175,6 @@ static void process_event(struct event_record* r, struct sock_plugin* plug)
             {
             send_error(plug, E_BADDOMAIN, r->icode , r->ivalue);
             }
-         else if (plug->dest->is_pv_domain)
-            {
-            send_error(plug, E_BADDOMAIN, r->icode , r->ivalue);
-            plug->dest=NULL;
-            }
         else
             { // Do we have the right dev slot?
             int devslot=plug->recived_slot;
@@ -491,7 +1188,7 @@ static void process_event(struct event_record* r, struct sock_plugin* plug)
 
     case VM_TAKE_FROM:
         if (plug->src)
-            plug->src->plugin=NULL;
+            plugin_unlink(plug);
 
         d=domain_with_domid(r->ivalue);
         if (!d)
@@ -500,6 +1197,7 @@ static void process_event(struct event_record* r, struct sock_plugin* plug)
            }
         else
            {
+                plug->next=d->plugin;
                 d->plugin=plug;
                 plug->src=d;
 
@@ -507,6 +1205,21 @@ static void process_event(struct event_record* r, struct sock_plugin* plug)
            }       
     break;
 
+    case VM_SHM:
+        if (!plug->shm && !plugin_shm_setup(plug) && (plug->s != -1))
+            send_error(plug, E_BADCODE, r->icode, 0);
+    break;
+
+    case VM_HELLO:
+        plugin_hello(plug, r->ivalue);
+    break;
+
+    case VM_ACK:
+        if ((int32_t) (r->ivalue - plug->frame_acked) > 0 &&
+            (int32_t) (plug->frame_seq - r->ivalue) >= 0)
+            plug->frame_acked = r->ivalue;
+    break;
+
     default:
         send_error(plug,E_BADCODE, r->icode, 0);
     }
@@ -520,10 +1233,10 @@ static void process_event(struct event_record* r, struct sock_plugin* plug)
 
 void send_event(struct sock_plugin* plug, int t, int c, int v)
 {
-    struct msg_dom0_input_event msg;
+    struct input_event e;
     struct domain* d = plug->dest;
 
-    if ((NULL==d) || (NULL == d->client)) 
+    if ((NULL==d) || (!d->is_pv_domain && (NULL == d->client)))
         return;
 
     if (t==EV_DEV)
@@ -537,10 +1250,11 @@ void send_event(struct sock_plugin* plug, int t, int c, int v)
             return;
     }
 
-    msg.type = t;
-    msg.code = c;
-    msg.value = v;
-    dom0_input_event(d->client, &msg, sizeof(msg));
+    gettimeofday(&e.time, NULL);
+    e.type = t;
+    e.code = c;
+    e.value = v;
+    input_plugin_send(d, &e);
 }
 
 static void server_accept(int fd, short event, void *opaque)
@@ -549,6 +1263,8 @@ static void server_accept(int fd, short event, void *opaque)
   int s2;
   socklen_t t;
   struct sockaddr_un remote;
+  struct sock_plugin* plug;
+  struct sock_plugin** table;
 
 
   t = sizeof (remote);
@@ -557,33 +1273,32 @@ static void server_accept(int fd, short event, void *opaque)
     info("Accept failed with %s",strerror(errno));
     return;
   }
-  if (buffers.s==-1)
-    {
-      buffers.src=NULL;
-      buffers.dest=NULL;
-      buffers.slot=INPUTSLOT_INVALID;
-      buffers.bytes_remaining=0;
-      buffers.position=0;
-      buffers.recived_slot=INPUTSLOT_INVALID;
-      buffers.dropped=false;
-      buffers.slot_dropped=false;
-      buffers.error=0;
-
-      buffers.resetall=0;
-      buffers.deq_size=0;
-      buffers.dev_events=NULL;
-      buffers.delayed=0;
-      buffers.s=s2;
-
-      info("Accepting client for Unix domain socket.");
-      event_set (&server_recv_event, s2,  EV_READ | EV_PERSIST,  wrapper_server_recv,  (void*)&buffers);
-      event_add (&server_recv_event, NULL);
-    }
-    else
+
+  plug = calloc(1, sizeof(struct sock_plugin));
+  table = realloc(plugins, (nplugins + 1) * sizeof(struct sock_plugin*));
+  if (!plug || !table)
     {
-    info("Second connection not allowed\n");
+    info("Out of memory for a new connection\n");
+    free(plug);
+    if (table)
+        plugins = table;
     close(s2);
+    return;
     }
+  plugins = table;
+  plugins[nplugins++] = plug;
+
+  plug->slot=INPUTSLOT_INVALID;
+  plug->recived_slot=INPUTSLOT_INVALID;
+  plug->version=INPUT_PROTO_V1;
+  plug->s=s2;
+
+  info("Accepting client %u for Unix domain socket.", nplugins);
+  event_set (&plug->recv_event, s2,  EV_READ | EV_PERSIST,  wrapper_server_recv,  (void*)plug);
+  event_priority_set (&plug->recv_event, EVENT_PRIORITY_INPUT);
+  event_add (&plug->recv_event, NULL);
+  event_set (&plug->send_event, s2, EV_WRITE, wrapper_server_send, (void*)plug);
+  event_priority_set (&plug->send_event, EVENT_PRIORITY_INPUT);
 }
 
 void socket_server_init(void)
@@ -591,9 +1306,13 @@ void socket_server_init(void)
     int len;
     struct sockaddr_un local;
     const char sock_path[]="/var/run/input_socket";
+    char overflow[16] = { 0 };
+
+    db_read(overflow, sizeof(overflow), "/input/plugin-overflow");
+    if (!strcmp(overflow, "drop-new"))
+        plugin_overflow = PLUGIN_OVERFLOW_DROP_NEW;
 
     info("Opening Unix domain socket in %s",sock_path);
-    buffers.s=-1;
 
     if ((server_sock_fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
         info("socket failed with %s",strerror(errno));
@@ -622,7 +1341,10 @@ void socket_server_init(void)
 
 void socket_server_close()
    {
+   while (nplugins)
+       kill_connection(plugins[0]);
+   free(plugins);
+   plugins=NULL;
    close(server_sock_fd);
-   free(buffers.dev_events);
    }
 
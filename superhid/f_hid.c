@@ -25,6 +25,9 @@
 static int major, minors;
 static struct class *hidg_class;
 
+/* IN requests each instance keeps, i.e. reports that can be in flight */
+#define HIDG_IN_REQS	8
+
 /*-------------------------------------------------------------------------*/
 /*                            HID gadget struct                            */
 
@@ -41,6 +44,8 @@ struct f_hidg {
 	unsigned short			report_desc_length;
 	char				*report_desc;
 	unsigned short			report_length;
+	unsigned char			fs_interval;
+	unsigned char			hs_interval;
 
 	/* recv report */
 	struct list_head		completed_out_req;
@@ -50,12 +55,14 @@ struct f_hidg {
 
 	/* send report */
 	struct mutex			lock;
-	bool				write_pending;
+	spinlock_t			write_spinlock;
+	struct list_head		free_in_req;
 	wait_queue_head_t		write_queue;
-	struct usb_request		*req;
+	struct usb_request		*in_req[HIDG_IN_REQS];
 
 	int				minor;
 	struct cdev			cdev;
+	struct device			*dev;
 	struct usb_function		func;
 
 	struct usb_ep			*in_ep;
@@ -100,10 +107,7 @@ static struct usb_endpoint_descriptor hidg_hs_in_ep_desc = {
 	.bEndpointAddress	= USB_DIR_IN,
 	.bmAttributes		= USB_ENDPOINT_XFER_INT,
 	/*.wMaxPacketSize	= DYNAMIC */
-	.bInterval		= 4, /* FIXME: Add this field in the
-				      * HID gadget configuration?
-				      * (struct hidg_func_descriptor)
-				      */
+	/*.bInterval		= DYNAMIC */
 };
 
 static struct usb_endpoint_descriptor hidg_hs_out_ep_desc = {
@@ -112,10 +116,7 @@ static struct usb_endpoint_descriptor hidg_hs_out_ep_desc = {
 	.bEndpointAddress	= USB_DIR_OUT,
 	.bmAttributes		= USB_ENDPOINT_XFER_INT,
 	/*.wMaxPacketSize	= DYNAMIC */
-	.bInterval		= 4, /* FIXME: Add this field in the
-				      * HID gadget configuration?
-				      * (struct hidg_func_descriptor)
-				      */
+	/*.bInterval		= DYNAMIC */
 };
 
 static struct usb_descriptor_header *hidg_hs_descriptors[] = {
@@ -134,10 +135,7 @@ static struct usb_endpoint_descriptor hidg_fs_in_ep_desc = {
 	.bEndpointAddress	= USB_DIR_IN,
 	.bmAttributes		= USB_ENDPOINT_XFER_INT,
 	/*.wMaxPacketSize	= DYNAMIC */
-	.bInterval		= 10, /* FIXME: Add this field in the
-				       * HID gadget configuration?
-				       * (struct hidg_func_descriptor)
-				       */
+	/*.bInterval		= DYNAMIC */
 };
 
 static struct usb_endpoint_descriptor hidg_fs_out_ep_desc = {
@@ -146,10 +144,7 @@ static struct usb_endpoint_descriptor hidg_fs_out_ep_desc = {
 	.bEndpointAddress	= USB_DIR_OUT,
 	.bmAttributes		= USB_ENDPOINT_XFER_INT,
 	/*.wMaxPacketSize	= DYNAMIC */
-	.bInterval		= 10, /* FIXME: Add this field in the
-				       * HID gadget configuration?
-				       * (struct hidg_func_descriptor)
-				       */
+	/*.bInterval		= DYNAMIC */
 };
 
 static struct usb_descriptor_header *hidg_fs_descriptors[] = {
@@ -233,75 +228,114 @@ static ssize_t f_hidg_read(struct file *file, char __user *buffer,
 	return count;
 }
 
+static void hidg_put_in_req(struct f_hidg *hidg, struct usb_request *req)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&hidg->write_spinlock, flags);
+	list_add_tail(&req->list, &hidg->free_in_req);
+	spin_unlock_irqrestore(&hidg->write_spinlock, flags);
+
+	wake_up(&hidg->write_queue);
+}
+
 static void f_hidg_req_complete(struct usb_ep *ep, struct usb_request *req)
 {
-	struct f_hidg *hidg = (struct f_hidg *)ep->driver_data;
+	struct f_hidg *hidg = (struct f_hidg *)req->context;
 
-	if (req->status != 0) {
+	if (req->status != 0 && req->status != -ESHUTDOWN) {
 		ERROR(hidg->func.config->cdev,
 			"End Point Request ERROR: %d\n", req->status);
 	}
 
-	hidg->write_pending = 0;
-	wake_up(&hidg->write_queue);
+	hidg_put_in_req(hidg, req);
 }
 
+static struct usb_request *hidg_get_in_req(struct f_hidg *hidg)
+{
+	struct usb_request *req = NULL;
+	unsigned long flags;
+
+	spin_lock_irqsave(&hidg->write_spinlock, flags);
+	if (!list_empty(&hidg->free_in_req)) {
+		req = list_first_entry(&hidg->free_in_req,
+				       struct usb_request, list);
+		list_del(&req->list);
+	}
+	spin_unlock_irqrestore(&hidg->write_spinlock, flags);
+
+	return req;
+}
+
+/*
+ * A write of several reports, each report_length long but the last,
+ * queues one request per report, so that a whole multitouch frame goes
+ * out in the same interval rather than one report per interval.
+ */
 static ssize_t f_hidg_write(struct file *file, const char __user *buffer,
 			    size_t count, loff_t *offp)
 {
 	struct f_hidg *hidg  = file->private_data;
-	ssize_t status = -ENOMEM;
+	struct usb_request *req;
+	size_t written = 0, len;
+	ssize_t status = 0;
 
 	if (!access_ok(VERIFY_READ, buffer, count))
 		return -EFAULT;
 
 	mutex_lock(&hidg->lock);
 
-#define WRITE_COND (!hidg->write_pending)
+#define WRITE_COND (!list_empty(&hidg->free_in_req))
 
-	/* write queue */
-	while (!WRITE_COND) {
-		mutex_unlock(&hidg->lock);
-		if (file->f_flags & O_NONBLOCK)
-			return -EAGAIN;
+	while (written < count) {
+		req = hidg_get_in_req(hidg);
+		if (!req) {
+			/* what is queued already is a short write */
+			if (written)
+				break;
 
-		if (wait_event_interruptible_exclusive(
-				hidg->write_queue, WRITE_COND))
-			return -ERESTARTSYS;
+			mutex_unlock(&hidg->lock);
+			if (file->f_flags & O_NONBLOCK)
+				return -EAGAIN;
 
-		mutex_lock(&hidg->lock);
-	}
+			if (wait_event_interruptible_exclusive(
+					hidg->write_queue, WRITE_COND))
+				return -ERESTARTSYS;
 
-	count  = min_t(unsigned, count, hidg->report_length);
-	status = copy_from_user(hidg->req->buf, buffer, count);
+			mutex_lock(&hidg->lock);
+			continue;
+		}
 
-	if (status != 0) {
-		ERROR(hidg->func.config->cdev,
-			"copy_from_user error\n");
-		mutex_unlock(&hidg->lock);
-		return -EINVAL;
-	}
+		len = min_t(size_t, count - written, hidg->report_length);
+		if (copy_from_user(req->buf, buffer + written, len)) {
+			ERROR(hidg->func.config->cdev,
+				"copy_from_user error\n");
+			hidg_put_in_req(hidg, req);
+			status = -EINVAL;
+			break;
+		}
 
-	hidg->req->status   = 0;
-	hidg->req->zero     = 0;
-	hidg->req->length   = count;
-	hidg->req->complete = f_hidg_req_complete;
-	hidg->req->context  = hidg;
-	hidg->write_pending = 1;
+		req->status   = 0;
+		req->zero     = 0;
+		req->length   = len;
+		req->complete = f_hidg_req_complete;
+		req->context  = hidg;
 
-	status = usb_ep_queue(hidg->in_ep, hidg->req, GFP_ATOMIC);
-	if (status < 0) {
-		ERROR(hidg->func.config->cdev,
-			"usb_ep_queue error on int endpoint %zd\n", status);
-		hidg->write_pending = 0;
-		wake_up(&hidg->write_queue);
-	} else {
-		status = count;
+		status = usb_ep_queue(hidg->in_ep, req, GFP_ATOMIC);
+		if (status < 0) {
+			ERROR(hidg->func.config->cdev,
+				"usb_ep_queue error on int endpoint %zd\n",
+				status);
+			hidg_put_in_req(hidg, req);
+			break;
+		}
+
+		written += len;
 	}
 
 	mutex_unlock(&hidg->lock);
 
-	return status;
+	return written ? written : status;
 }
 
 static unsigned int f_hidg_poll(struct file *file, poll_table *wait)
@@ -576,11 +610,38 @@ const struct file_operations f_hidg_fops = {
 	.llseek		= noop_llseek,
 };
 
+/* Writers pad each report of a write to this, read it per instance as
+ * the module parameter only applies to the next hidg created. */
+static ssize_t hidg_report_length_show(struct device *dev,
+				       struct device_attribute *attr,
+				       char *buf)
+{
+	struct f_hidg *hidg = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%u\n", hidg->report_length);
+}
+
+static DEVICE_ATTR(report_length, S_IRUGO, hidg_report_length_show, NULL);
+
+static void hidg_free_in_reqs(struct f_hidg *hidg)
+{
+	int i;
+
+	for (i = 0; i < HIDG_IN_REQS; i++) {
+		if (hidg->in_req[i] == NULL)
+			continue;
+		kfree(hidg->in_req[i]->buf);
+		usb_ep_free_request(hidg->in_ep, hidg->in_req[i]);
+		hidg->in_req[i] = NULL;
+	}
+	INIT_LIST_HEAD(&hidg->free_in_req);
+}
+
 static int __init hidg_bind(struct usb_configuration *c, struct usb_function *f)
 {
 	struct usb_ep		*ep;
 	struct f_hidg		*hidg = func_to_hidg(f);
-	int			status;
+	int			status, i;
 	dev_t			dev;
 
 	/* allocate instance-specific interface IDs, and patch descriptors */
@@ -603,15 +664,21 @@ static int __init hidg_bind(struct usb_configuration *c, struct usb_function *f)
 	ep->driver_data = c->cdev;	/* claim */
 	hidg->out_ep = ep;
 
-	/* preallocate request and buffer */
+	/* preallocate the pool of IN requests and their buffers */
+	spin_lock_init(&hidg->write_spinlock);
+	INIT_LIST_HEAD(&hidg->free_in_req);
 	status = -ENOMEM;
-	hidg->req = usb_ep_alloc_request(hidg->in_ep, GFP_KERNEL);
-	if (!hidg->req)
-		goto fail;
+	for (i = 0; i < HIDG_IN_REQS; i++) {
+		hidg->in_req[i] = usb_ep_alloc_request(hidg->in_ep, GFP_KERNEL);
+		if (!hidg->in_req[i])
+			goto fail;
 
-	hidg->req->buf = kmalloc(hidg->report_length, GFP_KERNEL);
-	if (!hidg->req->buf)
-		goto fail;
+		hidg->in_req[i]->buf = kmalloc(hidg->report_length, GFP_KERNEL);
+		if (!hidg->in_req[i]->buf)
+			goto fail;
+		hidg->in_req[i]->context = hidg;
+		list_add_tail(&hidg->in_req[i]->list, &hidg->free_in_req);
+	}
 
 	/* set descriptor dynamic values */
 	hidg_interface_desc.bInterfaceSubClass = hidg->bInterfaceSubClass;
@@ -620,6 +687,10 @@ static int __init hidg_bind(struct usb_configuration *c, struct usb_function *f)
 	hidg_fs_in_ep_desc.wMaxPacketSize = cpu_to_le16(hidg->report_length);
 	hidg_hs_out_ep_desc.wMaxPacketSize = cpu_to_le16(hidg->report_length);
 	hidg_fs_out_ep_desc.wMaxPacketSize = cpu_to_le16(hidg->report_length);
+	hidg_hs_in_ep_desc.bInterval = hidg->hs_interval;
+	hidg_hs_out_ep_desc.bInterval = hidg->hs_interval;
+	hidg_fs_in_ep_desc.bInterval = hidg->fs_interval;
+	hidg_fs_out_ep_desc.bInterval = hidg->fs_interval;
 	hidg_desc.desc[0].bDescriptorType = HID_DT_REPORT;
 	hidg_desc.desc[0].wDescriptorLength =
 		cpu_to_le16(hidg->report_desc_length);
@@ -647,7 +718,13 @@ static int __init hidg_bind(struct usb_configuration *c, struct usb_function *f)
 	if (status)
 		goto fail_free_descs;
 
-	device_create(hidg_class, NULL, dev, NULL, "%s%d", "hidg", hidg->minor);
+	hidg->dev = device_create(hidg_class, NULL, dev, hidg, "%s%d",
+				  "hidg", hidg->minor);
+	if (IS_ERR(hidg->dev))
+		hidg->dev = NULL;
+	else if (device_create_file(hidg->dev, &dev_attr_report_length))
+		ERROR(f->config->cdev, "hidg%d: no report_length attribute\n",
+		      hidg->minor);
 
 	return 0;
 
@@ -655,11 +732,7 @@ fail_free_descs:
 	usb_free_all_descriptors(f);
 fail:
 	ERROR(f->config->cdev, "hidg_bind FAILED\n");
-	if (hidg->req != NULL) {
-		kfree(hidg->req->buf);
-		if (hidg->in_ep != NULL)
-			usb_ep_free_request(hidg->in_ep, hidg->req);
-	}
+	hidg_free_in_reqs(hidg);
 
 	return status;
 }
@@ -668,14 +741,15 @@ static void hidg_unbind(struct usb_configuration *c, struct usb_function *f)
 {
 	struct f_hidg *hidg = func_to_hidg(f);
 
+	if (hidg->dev)
+		device_remove_file(hidg->dev, &dev_attr_report_length);
 	device_destroy(hidg_class, MKDEV(major, hidg->minor));
 	cdev_del(&hidg->cdev);
 
-	/* disable/free request and end point */
+	/* disable/free requests and end point; disabling it gives back
+	 * whatever was still in flight */
 	usb_ep_disable(hidg->in_ep);
-	usb_ep_dequeue(hidg->in_ep, hidg->req);
-	kfree(hidg->req->buf);
-	usb_ep_free_request(hidg->in_ep, hidg->req);
+	hidg_free_in_reqs(hidg);
 
 	usb_free_all_descriptors(f);
 
@@ -707,7 +781,9 @@ static struct usb_gadget_strings *ct_func_strings[] = {
 /*                             usb_configuration                           */
 
 int __init hidg_bind_config(struct usb_configuration *c,
-			    struct hidg_func_descriptor *fdesc, int index)
+			    struct hidg_func_descriptor *fdesc,
+			    unsigned char fs_interval,
+			    unsigned char hs_interval, int index)
 {
 	struct f_hidg *hidg;
 	int status;
@@ -733,6 +809,8 @@ int __init hidg_bind_config(struct usb_configuration *c,
 	hidg->bInterfaceSubClass = fdesc->subclass;
 	hidg->bInterfaceProtocol = fdesc->protocol;
 	hidg->report_length = fdesc->report_length;
+	hidg->fs_interval = fs_interval;
+	hidg->hs_interval = hs_interval;
 	hidg->report_desc_length = fdesc->report_desc_length;
 	hidg->report_desc = kmemdup(fdesc->report_desc,
 				    fdesc->report_desc_length,
@@ -42,6 +42,15 @@
 struct hidg_func_node {
 	struct list_head node;
 	struct hidg_func_descriptor *func;
+	unsigned char fs_interval;
+	unsigned char hs_interval;
+};
+
+/* What each hidg platform device carries, fixed when it is created */
+struct superhid_platform_data {
+	unsigned char fs_interval;
+	unsigned char hs_interval;
+	struct hidg_func_descriptor func;	/* last, report_desc follows */
 };
 
 struct hidg_device_node {
@@ -53,6 +62,27 @@ static LIST_HEAD(hidg_func_list);
 
 static LIST_HEAD(hidg_devices);
 
+/*
+ * Polling interval and report length of the next hidg to be created.
+ * They can be changed at runtime, under /sys/module/superhid/parameters,
+ * before reading new_superhid, so each instance can run at its own rate.
+ */
+static unsigned int fs_interval = 10;
+module_param(fs_interval, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(fs_interval, "Full speed polling interval in ms (1-255)");
+
+static unsigned int hs_interval = 4;
+module_param(hs_interval, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(hs_interval, "High speed polling interval, 2^(n-1) microframes (1-16)");
+
+/* The longest report in the descriptor, the digitizer's: report id,
+ * flags, X and Y */
+#define SUPERHID_REPORT_MIN 6
+
+static unsigned int report_length = 8;
+module_param(report_length, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(report_length, "Longest report in bytes (6-64)");
+
 /*-------------------------------------------------------------------------*/
 USB_GADGET_COMPOSITE_OPTIONS();
 
@@ -129,7 +159,8 @@ static int __init do_config(struct usb_configuration *c)
 	}
 
 	list_for_each_entry(e, &hidg_func_list, node) {
-		status = hidg_bind_config(c, e->func, func++);
+		status = hidg_bind_config(c, e->func, e->fs_interval,
+					  e->hs_interval, func++);
 		if (status)
 			break;
 	}
@@ -192,10 +223,10 @@ static int __exit hid_unbind(struct usb_composite_dev *cdev)
 
 static int __init hidg_plat_driver_probe(struct platform_device *pdev)
 {
-	struct hidg_func_descriptor *func = dev_get_platdata(&pdev->dev);
+	struct superhid_platform_data *pdata = dev_get_platdata(&pdev->dev);
 	struct hidg_func_node *entry;
 
-	if (!func) {
+	if (!pdata) {
 		dev_err(&pdev->dev, "Platform data missing\n");
 		return -ENODEV;
 	}
@@ -204,7 +235,9 @@ static int __init hidg_plat_driver_probe(struct platform_device *pdev)
 	if (!entry)
 		return -ENOMEM;
 
-	entry->func = func;
+	entry->func = &pdata->func;
+	entry->fs_interval = pdata->fs_interval;
+	entry->hs_interval = pdata->hs_interval;
 	list_add_tail(&entry->node, &hidg_func_list);
 
 	return 0;
@@ -366,9 +399,38 @@ static int create_new_hidg(void)
 	struct platform_device *dev;
 	int ret;
 	struct hidg_device_node *entry;
+	struct superhid_platform_data *pdata;
+	size_t len;
+
+	if (fs_interval < 1 || fs_interval > 255 ||
+	    hs_interval < 1 || hs_interval > 16 ||
+	    report_length < SUPERHID_REPORT_MIN || report_length > 64) {
+		printk("SuperHID Gadget: bad fs_interval, hs_interval or report_length\n");
+		return -EINVAL;
+	}
+
+	/* Each device gets its own copy, with this instance's settings */
+	len = sizeof(*pdata) + my_hid_data.report_desc_length;
+	pdata = kzalloc(len, GFP_KERNEL);
+	if (!pdata)
+		return -ENOMEM;
+	memcpy(&pdata->func, &my_hid_data,
+	       sizeof(my_hid_data) + my_hid_data.report_desc_length);
+	pdata->func.report_length = report_length;
+	pdata->fs_interval = fs_interval;
+	pdata->hs_interval = hs_interval;
 
 	dev = platform_device_alloc("hidg", id);
-	dev->dev.platform_data = &my_hid_data;
+	if (!dev) {
+		kfree(pdata);
+		return -ENOMEM;
+	}
+	ret = platform_device_add_data(dev, pdata, len);
+	kfree(pdata);
+	if (ret) {
+		platform_device_put(dev);
+		return ret;
+	}
 
 	ret = platform_device_add(dev);
 
@@ -28,6 +28,9 @@
 #include <event.h>
 #include <linux/input.h>
 #include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "xc_input_socket_protocol.h"
 
 #define SOCK_PATH "/var/run/input_socket"
 #define MAGIC 0xAD9CBCE9
@@ -51,6 +54,9 @@
 #define ABS_MT_SLOT		0x2f
 #define EV_DEV			0x06
 #define DEV_SET			0x01
+#define EV_VM			0x07
+#define VM_TAKE_FROM		0x02
+#define VM_SHM			0x04
 
 /* All the following is specific to the superhid digitizer */
 #define TIP_SWITCH	0x01
@@ -68,6 +74,16 @@
 /* This is actually 8, but we don't want to segv if input_server sends 10 */
 #define MAX_FINGERS	10
 
+/* Reports queued towards the gadget while it is busy */
+#define HID_QUEUE_LEN	64
+
+/* The gadget makes one report of every report_length bytes of a write,
+ * and has this many requests to put them in. */
+#define HID_WRITE_REPORTS	8
+#define HID_REPORT_LENGTH	8
+#define HID_REPORT_LENGTH_MAX	64
+#define HID_REPORT_LENGTH_ATTR	"/sys/class/hidg/hidg0/report_length"
+
 struct event_record
 {
   uint32_t magic;
@@ -97,6 +113,20 @@ struct superhid_report
 int hid_fd;
 struct event recv_event;
 
+/* Reports waiting for the gadget, written out when it polls writable */
+struct superhid_report hid_queue[HID_QUEUE_LEN];
+unsigned int hid_head;
+unsigned int hid_count;
+unsigned long hid_dropped;
+struct event hid_event;
+int hid_waiting;
+unsigned int hid_report_length = HID_REPORT_LENGTH;
+
+/* Shared memory transport, when asked for on the command line */
+struct input_shm_ring *shm;
+struct event shm_event;
+int shm_fds[2] = { -1, -1 };
+
 static void stop ()
 {
   event_del (&recv_event);
@@ -112,6 +142,112 @@ static uint16_t swap_bytes(uint16_t n)
   return res;
 }
 
+static void hid_callback (int fd, short event, void *opaque);
+
+/* Find out how far apart hidg0 wants the reports of one write. Reports
+ * are shorter than that and get zero padded. A gadget too old to tell
+ * uses the default. */
+static void hid_get_report_length (void)
+{
+  unsigned int len;
+  FILE *f;
+
+  f = fopen (HID_REPORT_LENGTH_ATTR, "r");
+  if (!f)
+    return;
+  if (fscanf (f, "%u", &len) == 1 &&
+      len >= sizeof (struct superhid_report) && len <= HID_REPORT_LENGTH_MAX)
+    hid_report_length = len;
+  fclose (f);
+}
+
+/* Write out what the gadget will take, as many reports per write as it
+ * has requests for, and wait for it to poll writable again if it won't
+ * take it all. */
+static void hid_flush (void)
+{
+  static uint8_t buf[HID_WRITE_REPORTS * HID_REPORT_LENGTH_MAX];
+  unsigned int i, count, done;
+  ssize_t n;
+
+  while (hid_count && !hid_waiting)
+  {
+    count = hid_count < HID_WRITE_REPORTS ? hid_count : HID_WRITE_REPORTS;
+    memset (buf, 0, count * hid_report_length);
+    for (i = 0; i < count; i++)
+      memcpy (&buf[i * hid_report_length],
+              &hid_queue[(hid_head + i) % HID_QUEUE_LEN],
+              sizeof (struct superhid_report));
+
+    n = write (hid_fd, buf, count * hid_report_length);
+
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0 && errno == EAGAIN)
+    {
+      event_set (&hid_event, hid_fd, EV_WRITE, hid_callback, NULL);
+      event_add (&hid_event, NULL);
+      hid_waiting = 1;
+      return;
+    }
+    if (n < 0)
+    {
+      perror ("/dev/hidg0");
+      done = count;
+    }
+    else
+      /* A short write stops on a report boundary, the rest is retried */
+      done = (n + hid_report_length - 1) / hid_report_length;
+
+    hid_head = (hid_head + done) % HID_QUEUE_LEN;
+    hid_count -= done;
+  }
+}
+
+static void hid_callback (int fd, short event, void *opaque)
+{
+  hid_waiting = 0;
+  hid_flush ();
+}
+
+/* Queue a report for the gadget. A finger that only moved since its last
+ * queued report, which has not gone out yet, just gets its position
+ * updated: the host only wants where the finger is now. Reports that
+ * change the finger's state are always kept. */
+static void hid_send (const struct superhid_report *report)
+{
+  struct superhid_report *q;
+  unsigned int i;
+
+  for (i = hid_count; i > 0; i--)
+  {
+    q = &hid_queue[(hid_head + i - 1) % HID_QUEUE_LEN];
+    if ((q->misc & 0xF8) != (report->misc & 0xF8))
+      continue;
+    /* The gadget takes whole reports, so anything still queued, the head
+     * of a write that came back short included, is ours to change. */
+    if (q->report_id == report->report_id && q->misc == report->misc)
+    {
+      q->x = report->x;
+      q->y = report->y;
+      return;
+    }
+    break;
+  }
+
+  if (hid_count == HID_QUEUE_LEN)
+  {
+    /* The gadget is not keeping up, lose the oldest report */
+    hid_head = (hid_head + 1) % HID_QUEUE_LEN;
+    hid_count--;
+    if (!(hid_dropped++ % 100))
+      printf ("Gadget busy, %lu reports dropped\n", hid_dropped);
+  }
+
+  hid_queue[(hid_head + hid_count) % HID_QUEUE_LEN] = *report;
+  hid_count++;
+}
+
 /* This function simulates a touchscreen from a mouse. */
 /* Useful to debug the driver without a tablet handy! */
 static int process_relative_event(uint16_t itype, uint16_t icode, uint32_t ivalue,
@@ -150,7 +286,7 @@ static int process_relative_event(uint16_t itype, uint16_t icode, uint32_t ivalu
   report.x = x;
   report.y = y;
 
-  write(hid_fd, &report, 6);
+  hid_send(&report);
 
   if (middle)
   {
@@ -158,7 +294,7 @@ static int process_relative_event(uint16_t itype, uint16_t icode, uint32_t ivalu
     report.misc &= 0xF7;
     report.misc |= FINGER_2;
     report.x = report.x + 50;
-    write(hid_fd, &report, 6);
+    hid_send(&report);
   }
 
   if (right)
@@ -170,7 +306,7 @@ static int process_relative_event(uint16_t itype, uint16_t icode, uint32_t ivalu
       report.x = report.x + 50;
     else
       report.x = report.x + 100;
-    write(hid_fd, &report, 6);
+    hid_send(&report);
   }
 
   return 1;
@@ -217,7 +353,7 @@ static void process_absolute_event(uint16_t itype, uint16_t icode, uint32_t ival
       /* We force a SYN_REPORT on ABS_MT_SLOT, because the device is serial. */
       /* However, we don't want to send twice the same event for nothing... */
       if (!just_syned)
-        write(hid_fd, &(report[finger]), 6);
+        hid_send(&(report[finger]));
       finger = ivalue;
       break;
     case ABS_MT_TRACKING_ID:
@@ -240,7 +376,7 @@ static void process_absolute_event(uint16_t itype, uint16_t icode, uint32_t ival
     switch (icode)
     {
     case SYN_REPORT:
-      write(hid_fd, &(report[finger]), 6);
+      hid_send(&(report[finger]));
       just_syned = 1;
       /* re-init */
       /* Nothing to do? */
@@ -256,6 +392,33 @@ static void process_absolute_event(uint16_t itype, uint16_t icode, uint32_t ival
   just_syned = 0;
 }
 
+static void shm_callback (int fd, short event, void *opaque);
+
+/* input_server answered our VM_SHM, the fds came along with the record */
+static void shm_attach (struct event_record *r)
+{
+  size_t len = sizeof (struct input_shm_ring) + r->ivalue * EVENT_SIZE;
+
+  if (shm_fds[0] == -1 || (r->ivalue & (r->ivalue - 1)))
+  {
+    printf ("Bad shared memory answer\n");
+    return;
+  }
+
+  shm = mmap (NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fds[0], 0);
+  close (shm_fds[0]);
+  shm_fds[0] = -1;
+  if (shm == MAP_FAILED)
+  {
+    perror ("mmap");
+    exit (1);
+  }
+
+  event_set (&shm_event, shm_fds[1], EV_READ | EV_PERSIST, shm_callback, NULL);
+  event_add (&shm_event, NULL);
+  printf ("Using a %u record shared memory ring\n", shm->size);
+}
+
 static void process_event (struct event_record *r, struct buffer_t *b)
 {
   uint16_t itype;
@@ -271,6 +434,12 @@ static void process_event (struct event_record *r, struct buffer_t *b)
   icode = r->icode;
   ivalue = r->ivalue;
 
+  if (itype == EV_VM && icode == VM_SHM)
+  {
+    shm_attach (r);
+    return;
+  }
+
   if (itype == EV_KEY && icode == BTN_LEFT)
     left = !!ivalue;
   if (itype == EV_KEY && icode == BTN_MIDDLE)
@@ -334,16 +503,51 @@ struct event_record *findnext (struct buffer_t *b)
     return NULL;
 }
 
+static void shm_callback (int fd, short event, void *opaque)
+{
+  struct event_record *records = (struct event_record *) (shm + 1);
+  uint32_t tail = shm->tail;
+  uint64_t count;
+
+  if (read (fd, &count, sizeof (count)) != sizeof (count))
+    return;
+
+  while (tail != shm->head)
+  {
+    __sync_synchronize ();
+    process_event (&records[tail & (shm->size - 1)], &buffers);
+    __sync_synchronize ();
+    shm->tail = ++tail;
+  }
+  hid_flush ();
+}
+
 static void recv_callback (int fd, short event, void *opaque)
 {
   int n;
   struct buffer_t *buf = &buffers;
   char *b = buf->buffer;
+  char cbuf[CMSG_SPACE (sizeof (shm_fds))];
+  struct cmsghdr *cmsg;
+  struct msghdr msg;
+  struct iovec iov;
 
   memmove (b, &b[buf->position], buf->bytes_remaining);
   buf->position = 0;
-  size_t nbytes = 0;
-  n = recv (fd, &b[buf->bytes_remaining], buffersize - buf->bytes_remaining, 0);
+
+  iov.iov_base = &b[buf->bytes_remaining];
+  iov.iov_len = buffersize - buf->bytes_remaining;
+  memset (&msg, 0, sizeof (msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cbuf;
+  msg.msg_controllen = sizeof (cbuf);
+  n = recvmsg (fd, &msg, 0);
+
+  for (cmsg = CMSG_FIRSTHDR (&msg); n > 0 && cmsg; cmsg = CMSG_NXTHDR (&msg, cmsg))
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+        cmsg->cmsg_len == CMSG_LEN (sizeof (shm_fds)))
+      memcpy (shm_fds, CMSG_DATA (cmsg), sizeof (shm_fds));
 
   if (n > 0)
   {
@@ -352,6 +556,7 @@ static void recv_callback (int fd, short event, void *opaque)
 
     while ((r = findnext (buf)) != NULL)
       process_event (r, buf);
+    hid_flush ();
   }
   else if (n)
     printf ("Error %d\n", n);
@@ -365,8 +570,8 @@ void suck (int s, int d)
   struct event_record e;
 
   e.magic = MAGIC;
-  e.itype = 7;
-  e.icode = 0x2;
+  e.itype = EV_VM;
+  e.icode = VM_TAKE_FROM;
   e.ivalue = d;
 
   if (send (s, &e, sizeof (struct event_record), 0) == -1)
@@ -376,6 +581,23 @@ void suck (int s, int d)
   }
 }
 
+/* Ask input_server to deliver through a shared memory ring */
+void ask_shm (int s)
+{
+  struct event_record e;
+
+  e.magic = MAGIC;
+  e.itype = EV_VM;
+  e.icode = VM_SHM;
+  e.ivalue = 0;
+
+  if (send (s, &e, sizeof (struct event_record), 0) == -1)
+  {
+    perror ("send");
+    exit (1);
+  }
+}
+
 int main (int argc, char** argv)
 {
   int s, t, len;
@@ -383,9 +605,9 @@ int main (int argc, char** argv)
   char str[100];
   pthread_t output_thread_var;
 
-  if (argc != 2)
+  if (argc != 2 && !(argc == 3 && !strcmp(argv[2], "shm")))
   {
-    printf("Usage: superhidplugin <domid>\n");
+    printf("Usage: superhidplugin <domid> [shm]\n");
     exit(1);
   }
 
@@ -415,13 +637,16 @@ int main (int argc, char** argv)
   buffers.block = 0;
   buffers.s = s;
 
-  /* Now connect to the superhid device */
-  hid_fd = open("/dev/hidg0", O_RDWR, 0666);
+  /* Now connect to the superhid device. Writes must not stall the
+   * event loop while the host is slow to poll, so reports are queued
+   * and written as the gadget becomes writable. */
+  hid_fd = open("/dev/hidg0", O_RDWR | O_NONBLOCK, 0666);
   if (hid_fd == -1)
   {
     perror("/dev/hidg0");
     exit(1);
   }
+  hid_get_report_length ();
 
   event_init ();
 
@@ -429,6 +654,8 @@ int main (int argc, char** argv)
   event_add (&recv_event, NULL);
 
   suck (s, strtol(argv[1], NULL, 0));
+  if (argc == 3)
+    ask_shm (s);
 
   event_dispatch ();
 
@@ -23,39 +23,197 @@ static struct domain *current, *surface_current;
 
 extern int keyb_waits_for_click;
 
+/* Switcher settings, read from the db at startup and refreshed in the
+ * background, so that mouse switching never waits on dbd. xenmgr reports
+ * configuration changes, /switcher/enabled and self-switch-disabled are
+ * written without such a notification and are picked up by the timer. */
+#define SWITCHER_SETTINGS_REFRESH 5 /* s */
+
+static struct
+{
+    int enabled;
+    int self_switch_disabled;
+    int keyboard_follows_mouse;
+    int resistance;
+} settings;
+
+/* An empty value, as read for a missing key, leaves the default. */
 static int
-switcher_self_switch_disabled(void)
+switcher_parse_unless_false(const char *v, int def)
 {
-    char c;
+    if (!*v)
+        return def;
+    return (*v != '0' && *v != 'F' && *v != 'f');
+}
+
+static int
+switcher_parse_if_true(const char *v, int def)
+{
+    if (!*v)
+        return def;
+    return (*v == '1' || *v == 'T' || *v == 't');
+}
+
+static int
+switcher_parse_int(const char *v, int def)
+{
+    if (!*v)
+        return def;
+    return strtol(v, NULL, 0);
+}
+
+static const struct switcher_setting
+{
+    const char *path;
+    int *value;
+    int (*parse)(const char *v, int def);
+    int def;
+} switcher_settings[] = {
+    { "/switcher/enabled", &settings.enabled, switcher_parse_unless_false, 1 },
+    /* self switching is disabled by default */
+    { "/switcher/self-switch-disabled", &settings.self_switch_disabled, switcher_parse_if_true, 1 },
+    { "/switcher/keyboard_follows_mouse", &settings.keyboard_follows_mouse, switcher_parse_unless_false, 0 },
+    { "/switcher/resistance", &settings.resistance, switcher_parse_int, 10 },
+};
+
+static void
+switcher_settings_reload(void)
+{
+    char buf[16];
+    unsigned int i;
 
-    if (db_exists("/switcher/self-switch-disabled"))
+    for (i = 0; i < ARRAY_LEN(switcher_settings); i++)
     {
-        db_read(&c, 1, "/switcher/self-switch-disabled");
-        return (c == '1' || c == 'T' || c == 't');
+        const struct switcher_setting *s = &switcher_settings[i];
+
+        db_read(buf, sizeof (buf), s->path);
+        buf[sizeof (buf) - 1] = 0;
+        *s->value = s->parse(buf, s->def);
     }
+}
+
+static void
+switcher_setting_read(const char *value, void *opaque)
+{
+    const struct switcher_setting *s = opaque;
+
+    *s->value = s->parse(value, s->def);
+}
+
+void
+switcher_settings_refresh(void)
+{
+    unsigned int i;
+
+    for (i = 0; i < ARRAY_LEN(switcher_settings); i++)
+        db_read_async(switcher_settings[i].path, switcher_setting_read,
+                      (void *) &switcher_settings[i]);
+}
+
+static void
+switcher_settings_timer(int fd, short event, void *opaque)
+{
+    static struct event refresh_event;
+    struct timeval tv = { SWITCHER_SETTINGS_REFRESH, 0 };
+
+    if (!evtimer_initialized(&refresh_event))
+        evtimer_set(&refresh_event, switcher_settings_timer, NULL);
     else
-        return 1; /* disabled by default */
+        switcher_settings_refresh();
+    evtimer_add(&refresh_event, &tv);
 }
 
 int
-switcher_switch_graphic(struct domain *d, int force)
+switcher_resistance(void)
 {
-    int rc = TRUE;
-    gint domid;
+    return settings.resistance;
+}
+
+#define SURFMAN_INTERFACE "com.citrix.xenclient.surfman"
+
+/* Timeout surfman is given to make the domain visible, in ms */
+#define SET_VISIBLE_TIMEOUT 3000
+/* How long we wait for surfman's reply before giving up on it, in ms */
+#define SET_VISIBLE_REPLY_TIMEOUT (SET_VISIBLE_TIMEOUT + 1000)
+
+typedef void (*set_visible_cb_t)(struct domain *d, int ok);
+
+struct set_visible_req
+{
+  int domid;
+  set_visible_cb_t done;
+};
+
+static void
+switcher_set_visible_done (DBusGProxy *proxy, DBusGProxyCall *call, void *opaque)
+{
+  struct set_visible_req *req = opaque;
+  struct domain *d = domain_with_domid (req->domid);
+  GError *error = NULL;
+  int ok;
 
+  ok = dbus_g_proxy_end_call (proxy, call, &error, G_TYPE_INVALID);
+  if (!ok)
+    {
+      warning ("surfman set_visible for domid %d failed: %s", req->domid,
+               error ? error->message : "unknown error");
+      if (error)
+        g_error_free (error);
+    }
+  else if (d)
+    surface_current = d;
+
+  if (req->done)
+    req->done (d, ok);
+}
+
+/* Ask surfman to show the domain. Returns once the request is sent; done,
+ * if given, runs when surfman replies, fails or does not answer in time. */
+static int
+switcher_set_visible (struct domain *d, int force, set_visible_cb_t done)
+{
+  static DBusGProxy *proxy = NULL;
+  struct set_visible_req *req;
+
+  if (!proxy)
+    proxy = xcdbus_get_proxy (xcbus_conn, SURFMAN_SERVICE, SURFMAN_PATH, SURFMAN_INTERFACE);
+  if (!proxy)
+    return FALSE;
+
+  req = malloc (sizeof (*req));
+  if (!req)
+    return FALSE;
+  req->domid = d->domid;
+  req->done = done;
+
+  if (!dbus_g_proxy_begin_call_with_timeout (proxy, "set_visible",
+                                             switcher_set_visible_done, req, free,
+                                             SET_VISIBLE_REPLY_TIMEOUT,
+                                             G_TYPE_INT, d->domid,
+                                             G_TYPE_INT, SET_VISIBLE_TIMEOUT,
+                                             G_TYPE_BOOLEAN, force ? TRUE : FALSE,
+                                             G_TYPE_INVALID))
+    {
+      free (req);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Returns whether the request could be made, surfman's answer is only
+ * logged. */
+int
+switcher_switch_graphic(struct domain *d, int force)
+{
     if (!d)
         return -1;
 
-    if (switcher_self_switch_disabled() &&
+    if (settings.self_switch_disabled &&
         d == surface_current)
-        return rc;
+        return TRUE;
 
-    rc = com_citrix_xenclient_surfman_set_visible_
-        (xcbus_conn, SURFMAN_SERVICE, SURFMAN_PATH, d->domid, 3000,
-         force ? TRUE : FALSE);
-    if (rc)
-        surface_current = d;
-    return rc;
+    return switcher_set_visible(d, force, NULL);
 }
 
 void
@@ -65,28 +223,43 @@ switcher_unfocus_gpu (void)
   surface_current = NULL;
 }
 
-int
-switcher_switch (struct domain *d, int mouse_switch, int force)
+/* A switch is started by switcher_switch() and committed (focus, keyboard,
+ * xenstore) once surfman has made the domain visible. Requests arriving in
+ * between are not dropped: the latest one runs when the current completes.
+ * Whoever asked is told how it went through its switch_done_cb_t. */
+enum switch_state
 {
-  static GArray *domids=NULL;
-  int ret = -1;
-  static int follow = -1;
-  static int switching = 0;
-
-  if (!d) {
-    return -1;
-  }
-
-  /* this is protection against semiconcurrent switcher_switch invocations. Although this is
-   * mostly single threaded program, this function can be enter twice at same time due if another switch
-   * request comes while it is waiting for the blocking call to surfman to return. Doom and misery and
-   * displayed/keyboard focused vm disreptancy ensues */
-  if (switching) {
-      warning("switching already in progress");
-      return -1;
-  }
-  switching = 1;
+  SWITCH_IDLE,
+  SWITCH_WAIT_VISIBLE,
+};
 
+static struct
+{
+  enum switch_state state;
+  int domid;
+  int mouse_switch;
+  struct timeval start;
+  switch_done_cb_t done;
+  void *opaque;
+
+  int queued;
+  int next_domid;
+  int next_mouse_switch;
+  int next_force;
+  switch_done_cb_t next_done;
+  void *next_opaque;
+
+  /* end-to-end switch latency, in ms */
+  unsigned int last_ms;
+  unsigned int max_ms;
+  unsigned long count;
+} sw;
+
+/* Only once d is on screen: a switch surfman refuses leaves the keyboard
+ * and the absolute pointer where they were. */
+static void
+switcher_switch_commit (struct domain *d, int mouse_switch)
+{
   if (!keyb_waits_for_click)
     {
       /* For an application viewing VM, the keyboard may be directed to a
@@ -96,64 +269,157 @@ switcher_switch (struct domain *d, int mouse_switch, int force)
       save_prev_keyb_domain (current);
     }
 
+  if (!mouse_switch && input_domain_supports_abs(d))
+        input_domain_set_mouse(d);
+
+  if (current) xenstore_dom_write_int (current->domid, 0, "switcher/have_focus");
+
+  current = d;
+
+  if (mouse_switch && !settings.keyboard_follows_mouse)
+    input_set_mouse(d);
+  else
+    {
+      input_set(d);
+
+      /* For an application viewing VM, restore the keyboard to the domain
+       * that had it when we switched away from the VM. */
+      if (!d->divert_info)
+        restore_prev_keyb_domain (current);
+    }
+
+  xenstore_dom_write_int (current->domid, 1, "switcher/have_focus");
+  xenstore_write_int(current->domid, "/local/domain/0/switcher/focus");
+  /* reboots can benefit from focused uuid knowledge.. */
+  xenstore_write(current->uuid, "/local/domain/0/switcher/focus-uuid");
+
+  /* Set the keyboard LEDs as per the domain that has the keyboard. */
+  if ( (current->prev_keyb_domain_ptr != NULL) && (current->prev_keyb_domid != -1) &&
+       (current->prev_keyb_domain_ptr->domid == current->prev_keyb_domid) )
+    {
+      input_led_code (current->prev_keyb_domain_ptr->keyboard_led_code, current->prev_keyb_domain_ptr->domid);
+    }
+  else
+    {
+      input_led_code (current->keyboard_led_code, current->domid);
+    }
+}
+
+static void
+switcher_switch_done (struct domain *d, int committed)
+{
+  struct timeval now, diff;
+  switch_done_cb_t done = sw.done;
+
+  monotonic_time (&now);
+  timersub (&now, &sw.start, &diff);
+
+  if (committed)
+    {
+      sw.last_ms = diff.tv_sec * 1000 + diff.tv_usec / 1000;
+      if (sw.last_ms > sw.max_ms)
+        sw.max_ms = sw.last_ms;
+      sw.count++;
+      xenstore_write_int (sw.last_ms, "/local/domain/0/switcher/switch-latency-ms");
+      info ("switched to domid %d in %u ms (max %u ms over %lu switches)",
+            d->domid, sw.last_ms, sw.max_ms, sw.count);
+    }
+
+  sw.state = SWITCH_IDLE;
+  sw.done = NULL;
+  if (done)
+    done (sw.domid, committed, sw.opaque);
+
+  if (sw.queued)
+    {
+      struct domain *next = domain_with_domid (sw.next_domid);
+
+      sw.queued = 0;
+      if (!next ||
+          switcher_switch_cb (next, sw.next_mouse_switch, sw.next_force,
+                              sw.next_done, sw.next_opaque) < 0)
+        if (sw.next_done)
+          sw.next_done (sw.next_domid, 0, sw.next_opaque);
+    }
+}
+
+static void
+switcher_switch_visible (struct domain *d, int ok)
+{
+  /* The domain may have gone away while surfman was busy. */
+  if (d && d->domid == sw.domid && (ok || d->is_pvm))
+    {
+      switcher_switch_commit (d, sw.mouse_switch);
+      switcher_switch_done (d, 1);
+    }
+  else
+    switcher_switch_done (d, 0);
+}
+
+int
+switcher_switch (struct domain *d, int mouse_switch, int force)
+{
+  return switcher_switch_cb (d, mouse_switch, force, NULL, NULL);
+}
+
+/* Start a switch to d. Returns -1 if it could not be started, otherwise
+ * done (if not NULL) is called once it completed or failed, which may be
+ * before this returns. */
+int
+switcher_switch_cb (struct domain *d, int mouse_switch, int force,
+                    switch_done_cb_t done, void *opaque)
+{
+  if (!d) {
+    return -1;
+  }
+
+  /* Input keeps flowing while surfman works on a switch, so another request
+   * can come in. Keep the latest and start it once this one completes. */
+  if (sw.state != SWITCH_IDLE) {
+      info("switch to domid %d in progress, queueing switch to domid %d",
+           sw.domid, d->domid);
+      if (sw.queued && sw.next_done)
+        sw.next_done (sw.next_domid, 0, sw.next_opaque);
+      sw.queued = 1;
+      sw.next_domid = d->domid;
+      sw.next_mouse_switch = mouse_switch;
+      sw.next_force = force;
+      sw.next_done = done;
+      sw.next_opaque = opaque;
+      return 0;
+  }
+
   if (d->disabled_surface)
       info ("domid:%d disabled_surface:%d", d->domid, d->disabled_surface);
 
-  if (!mouse_switch && input_domain_supports_abs(d))
-        input_domain_set_mouse(d);
+  monotonic_time (&sw.start);
+  sw.domid = d->domid;
+  sw.mouse_switch = mouse_switch;
+  sw.done = done;
+  sw.opaque = opaque;
 
-  if (d->disabled_surface || switcher_switch_graphic(d, force) || d->is_pvm)
-  {
-        if (current) xenstore_dom_write_int (current->domid, 0, "switcher/have_focus");
-
-        current = d;
-
-	if (follow == -1)
-	  {
-	      char c;
-
-	      follow = 0;
-	      if (db_exists("/switcher/keyboard_follows_mouse"))
-	      {
-		  db_read(&c, 1, "/switcher/keyboard_follows_mouse");
-		  if (c != '0' && c != 'F' && c != 'f')
-		      follow = 1;
-	      }
-	  }
-
-        if (mouse_switch && !follow)
-            input_set_mouse(d);
-        else
-	  {
-            input_set(d);
-
-	    /* For an application viewing VM, restore the keyboard to the domain
-	     * that had it when we switched away from the VM. */
-	    if (!d->divert_info)
-            restore_prev_keyb_domain (current);
-	  }
-
-        xenstore_dom_write_int (current->domid, 1, "switcher/have_focus");
-        xenstore_write_int(current->domid, "/local/domain/0/switcher/focus");
-        /* reboots can benefit from focused uuid knowledge.. */
-        xenstore_write(current->uuid, "/local/domain/0/switcher/focus-uuid");
-
-        /* Set the keyboard LEDs as per the domain that has the keyboard. */
-        if ( (current->prev_keyb_domain_ptr != NULL) && (current->prev_keyb_domid != -1) &&
-             (current->prev_keyb_domain_ptr->domid == current->prev_keyb_domid) )
-        {
-            input_led_code (current->prev_keyb_domain_ptr->keyboard_led_code, current->prev_keyb_domain_ptr->domid);
-        }
-        else
+  if (d->disabled_surface ||
+      (settings.self_switch_disabled && d == surface_current))
+    {
+      switcher_switch_commit (d, mouse_switch);
+      switcher_switch_done (d, 1);
+      return 0;
+    }
+
+  sw.state = SWITCH_WAIT_VISIBLE;
+  if (!switcher_set_visible (d, force, switcher_switch_visible))
+    {
+      if (!d->is_pvm)
         {
-            input_led_code (current->keyboard_led_code, current->domid);
+          sw.state = SWITCH_IDLE;
+          sw.done = NULL;
+          return -1;
         }
-
-        ret = 0;
+      switcher_switch_commit (d, mouse_switch);
+      switcher_switch_done (d, 1);
     }
 
-  switching = 0;
-  return ret;
+  return 0;
 }
 
 
@@ -470,21 +736,10 @@ switcher_switch_on_mouse(struct input_event *e, int x, int y)
     if ((x > MIN_MOUSE_ABS_X) && (x < MAX_MOUSE_ABS_X))
         return;
 
-    if (db_exists("/switcher/enabled"))
-        {
-        char c;
-
-        db_read(&c, 1, "/switcher/enabled");
-        if (c == '0' || c == 'F' || c == 'f')
-            return;
-        }
-
-    domain_mouse_switch_config(current);
-
     if (x == 0)
     {
         slot = current->mouse_switch.left;
-        if (slot == -1)
+        if (slot == -1 || !settings.enabled)
             return;
         info("at the left of %d %d", current->slot, slot);
         if (!switcher_switch_makes_sense(current->slot, slot))
@@ -497,7 +752,7 @@ switcher_switch_on_mouse(struct input_event *e, int x, int y)
     } else if (x == MAX_MOUSE_ABS_X)
     {
         slot = current->mouse_switch.right;
-        if (slot == -1)
+        if (slot == -1 || !settings.enabled)
             return;
         info("at the right of %d %d", current->slot, slot);
 	    if (!switcher_switch_makes_sense(current->slot, slot))
@@ -588,6 +843,9 @@ switcher_init (void)
   xenstore_watch (switcher_watch_ac, NULL, "/pm/ac_adapter");
 #endif
 
+  switcher_settings_reload ();
+  switcher_settings_timer (-1, 0, NULL);
+
   for (i = 0; i < 10; i++)
     {
       int left[] = { KEY_LEFTCTRL, i ? KEY_1 + (i - 1) : KEY_0, -1 };
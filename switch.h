@@ -26,6 +26,9 @@ enum switcher_state
 
 #define MOUSE_SWITCH_PREV -2
 
+/* Completion of a switch, ok is false if it failed or was superseded */
+typedef void (*switch_done_cb_t)(int domid, int ok, void *opaque);
+
 #define KEYFOLLOWMOUSE  1
 #define CLICKHOLDFOCUS  2
 #define CLONEEVENTS     4
@@ -74,6 +77,12 @@ struct domain
     int                     desktop_xres;
     int                     desktop_yres;
     int                     num_active_adapters;
+    int                     input_caps;
+    struct input_batch      batch;
+    /* When a dmbus send to the device model last failed, if it did */
+    struct timeval          client_stalled;
+    struct input_rate       rate;
+    struct input_coalesce   coalesce;
 };
 
 struct callbacklist
@@ -121,7 +130,24 @@ uint32_t ivalue;
 } __attribute__((__packed__));
 
 
-#define buffersize (sizeof(struct event_record)*100)
+/* Bytes of the receive ring for a plugin connection, a power of two */
+#define PLUGIN_RECV_LEN 16384
+
+/* Records queued towards a plugin before the overflow policy kicks in */
+#define PLUGIN_SENDQ_LEN 256
+
+/* Bytes of encoded v2 frames buffered towards a plugin */
+#define PLUGIN_OUT_LEN 16384
+
+/* Input records towards a plugin whose latency is still to be taken */
+#define PLUGIN_LATENCY_LEN PLUGIN_SENDQ_LEN
+
+struct plugin_latency
+{
+struct timeval time;
+int type;
+uint64_t end;           /* stream offset of the record's last byte, 0 while its frame is open */
+};
 
 struct dev_event
 {
@@ -133,9 +159,13 @@ bool add;
 
 struct sock_plugin
 {
-char buffer[buffersize];
-unsigned int bytes_remaining;
-int position;
+/* Receive ring; records are copied out of it, so may wrap */
+char buffer[PLUGIN_RECV_LEN];
+unsigned int recv_head;
+unsigned int recv_count;
+unsigned long recv_bytes;
+unsigned long recv_records;
+unsigned long recv_junk;
 struct domain* src;
 struct domain* dest;
 int s;
@@ -144,11 +174,50 @@ int recived_slot;
 int dropped;
 int slot_dropped;
 
-int delayed;
-char partialBuffer[sizeof(struct event_record)];
+/* Send queue, a ring of records flushed with one sendmsg per frame.
+   sendq_offset is how much of the head record already went out. */
+struct event_record sendq[PLUGIN_SENDQ_LEN];
+unsigned int sendq_head;
+unsigned int sendq_count;
+unsigned int sendq_offset;
+struct event send_event;
+bool send_pending;
+unsigned long sends;
+unsigned long overflows;
+
+/* Shared memory ring, once the plugin asked for it */
+struct input_shm_ring* shm;
+size_t shm_len;
+int shm_efd;
+unsigned int shm_unsignalled;
+
+/* v2 framing, once negotiated with VM_HELLO */
+int version;
+uint32_t caps;
+struct timeval stamp;       /* kernel time of the record being sent */
+int stamp_type;             /* and the type of device it came from */
+struct input_frame_event frame[INPUT_FRAME_MAX];
+unsigned int frame_count;
+bool frame_keep;            /* frame holds more than motion */
+uint32_t frame_seq;
+uint32_t frame_acked;
+char out[PLUGIN_OUT_LEN];
+unsigned int out_off;
+unsigned int out_len;
 
 int resetall;
 int deq_size;
 struct dev_event* dev_events;
 uint32_t error;
+
+/* Latency samples, oldest first. Offsets count the bytes queued on and
+   taken by the socket; shm records leave when the plugin is signalled. */
+struct plugin_latency lat[PLUGIN_LATENCY_LEN];
+unsigned int lat_head;
+unsigned int lat_count;
+uint64_t lat_queued;
+uint64_t lat_sent;
+
+struct event recv_event;
+struct sock_plugin* next;   /* next plugin taking from the same src domain */
 };
@@ -18,7 +18,9 @@
 
 #include "project.h"
 
+#ifndef ABS_MT_PRESSURE
 #define ABS_MT_PRESSURE         0x3a    /* Pressure on contact area */
+#endif
 
 #define MOVE_MULT  0.02
 #define SCROLL_MULT 0.04
@@ -160,6 +162,9 @@ static int is_autoscroll_timer_set = 0;
 
 static struct event left_click_event;
 
+/* Set once a packet has been processed, the next event starts a new one */
+static int sync_recd = 1;
+
 /* get configured setting - true/false */
 int touchpad_get_tap_to_click_enabled(void)
 {
@@ -262,11 +267,18 @@ static int detect_finger(const struct touchpad_packet *tp, const struct touchpad
     return fingertouching;
 }
 
+/* Events made up while processing a packet carry the packet's evdev time,
+ * the ones timers make up later carry the time they fire. */
+static const struct timeval *packet_time;
+
 static void populate_input_event(struct input_event *ev, int type, int code, int value)
 {
     struct timeval now;
 
-    gettimeofday(&now,NULL);
+    if (packet_time)
+        now = *packet_time;
+    else
+        gettimeofday(&now,NULL);
     ev->time = now;
     ev->type = type;
     ev->code = code;
@@ -1034,9 +1046,16 @@ static void process_packet(struct touchpad_state *ts,
     save_previous_packet_values(ts, tp, tl);
 }
 
+/* The kernel dropped events: forget the half read packet, and don't turn
+ * the jump to wherever the finger is now into a move. */
+void touchpad_resync(void)
+{
+    sync_recd = 1;
+    tstate.packet_count_move = 0;
+}
+
 void handle_touchpad_event(struct input_event *ev,int slot)
 {
-    static int sync_recd = 1;
     gSlot=slot;
 
     if (sync_recd == 1)
@@ -1050,7 +1069,9 @@ void handle_touchpad_event(struct input_event *ev,int slot)
         /* Packet is complete, now process it. */
         tpacket.timestamp = ev->time;
         sync_recd = 1;
+        packet_time = &ev->time;
         process_packet(&tstate, &tpacket, &tlimits, &tconfig);
+        packet_time = NULL;
     }
     else if (ev->type == EV_ABS)
     {
@@ -1194,21 +1215,20 @@ static void compute_touchpad_speed(struct touchpad_config *tc, struct touchpad_l
     }
 }
 
-int init_touchpad(int fd)
+/* Set up the touchpad from its axis ranges. Used directly when replaying a
+ * capture, where there is no device node to ask. */
+int init_touchpad_ranges(const struct input_ranges *r)
 {
     const double default_edge_mult = 0.17;
     const double edge_mult_low_res = 0.20;
     const double clickpad_bottom_edge_mult = 0.20;
     const double clickpad_left_button_maxx_mult = 0.50;
 
-    struct input_absinfo absinfo;
-    int ret = 0;
     int width;
     int height;
     int diag;
     double edge_width;
     double edge_mult = default_edge_mult;
-    unsigned long keybits[NBITS(KEY_MAX)];
 
     struct stat stat_buf;
     const char *disable_touchpad_file = "/config/disable-touchpad";
@@ -1220,37 +1240,13 @@ int init_touchpad(int fd)
         return -1;
     }
 
-    memset(keybits, 0, sizeof(keybits));
-
-    if ((ret = ioctl(fd, EVIOCGABS(ABS_X), &absinfo)) < 0)
-        return ret;
-    tlimits.minx = absinfo.minimum;
-    tlimits.maxx = absinfo.maximum;
-
-    if ((ret = ioctl(fd, EVIOCGABS(ABS_Y), &absinfo)) < 0)
-        return ret;
-    tlimits.miny = absinfo.minimum;
-    tlimits.maxy = absinfo.maximum;
-
-    if ((ret = ioctl(fd, EVIOCGABS(ABS_PRESSURE), &absinfo)) < 0)
-        return ret;
-    tlimits.min_pressure = absinfo.minimum;
-    tlimits.max_pressure = absinfo.maximum;
-
-    if ((ret = ioctl(fd, EVIOCGBIT(EV_KEY, sizeof(keybits)), keybits)) < 0)
-        return ret;
-
-    /* Clickpads only report left button. */
-    if (TEST_BIT(BTN_LEFT, keybits) &&
-        !TEST_BIT(BTN_RIGHT, keybits) &&
-        !TEST_BIT(BTN_MIDDLE, keybits))
-    {
-        tlimits.is_clickpad = 1;
-    }
-    else
-    {
-        tlimits.is_clickpad = 0;
-    }
+    tlimits.minx = r->x.minimum;
+    tlimits.maxx = r->x.maximum;
+    tlimits.miny = r->y.minimum;
+    tlimits.maxy = r->y.maximum;
+    tlimits.min_pressure = r->pressure.minimum;
+    tlimits.max_pressure = r->pressure.maximum;
+    tlimits.is_clickpad = r->clickpad;
     tlimits.is_clickpad_pressed = 0;
 
     /* Calculate minimum distance for a move event to be generated. */
@@ -1301,6 +1297,34 @@ int init_touchpad(int fd)
 
     add_touchpad_bindings();
 
+    return 0;
+}
+
+int init_touchpad(int fd)
+{
+    struct input_ranges r;
+    unsigned long keybits[NBITS(KEY_MAX)];
+    int ret;
+
+    memset(keybits, 0, sizeof(keybits));
+
+    if ((ret = ioctl(fd, EVIOCGABS(ABS_X), &r.x)) < 0)
+        return ret;
+    if ((ret = ioctl(fd, EVIOCGABS(ABS_Y), &r.y)) < 0)
+        return ret;
+    if ((ret = ioctl(fd, EVIOCGABS(ABS_PRESSURE), &r.pressure)) < 0)
+        return ret;
+    if ((ret = ioctl(fd, EVIOCGBIT(EV_KEY, sizeof(keybits)), keybits)) < 0)
+        return ret;
+
+    /* Clickpads only report left button. */
+    r.clickpad = TEST_BIT(BTN_LEFT, keybits) &&
+        !TEST_BIT(BTN_RIGHT, keybits) &&
+        !TEST_BIT(BTN_MIDDLE, keybits);
+
+    if ((ret = init_touchpad_ranges(&r)) < 0)
+        return ret;
+
     if (tlimits.is_clickpad)
     {
         info("device on fd %d is a clickpad", fd);
@@ -23,7 +23,7 @@
 
 #define btnleft_newlypressed 2
 
-struct tablet_scaling_params
+struct tablet_state
 {
     double x_mult;
     double y_mult;
@@ -32,11 +32,9 @@ struct tablet_scaling_params
     uint8_t subtype;
     uint8_t btnleft;
     int tool;
+    int ignore_events;
 };
 
-static struct tablet_scaling_params tscale[N_DEVS];
-static int ignore_events[N_DEVS];
-
 #ifndef ABS_MT_SLOT
 #define ABS_MT_SLOT 0x2f
 #endif
@@ -128,7 +126,7 @@ void set_and_inject_event(int slot,  struct input_event* ev, int type, int code,
     check_and_inject_event(ev,slot, HID_TYPE_TABLET);
 }
 
-void handle_usb_tablet_event (struct input_event *ev, int slot)
+void handle_usb_tablet_event (struct input_event *ev, int slot, struct tablet_state *t)
 {
     static int pen_inrange=0;
 
@@ -138,8 +136,6 @@ void handle_usb_tablet_event (struct input_event *ev, int slot)
     new_ev.code = ev->code;
     new_ev.value = ev->value;
 
-    struct tablet_scaling_params* t = &(tscale[slot]);
-
     if (new_ev.type == EV_ABS)
     {
 	if (!pen_inrange || (t->subtype!=SUBTYPE_MONOTOUCH))
@@ -217,14 +213,14 @@ void handle_usb_tablet_event (struct input_event *ev, int slot)
 
     if (new_ev.type == EV_SYN && new_ev.code == SYN_DROPPED)
     {
-        ignore_events[slot] = 1;
+        t->ignore_events = 1;
         info ("Ignoring events from event%d until next packet begins", slot);
     }
-    else if (ignore_events[slot]) 
+    else if (t->ignore_events) 
     {
 	if  (new_ev.type == EV_SYN && new_ev.code == SYN_REPORT)
 	    {
-            ignore_events[slot] = 0;
+            t->ignore_events = 0;
             info ("End of dropped packet from event%d", slot);
 	    }
 	else
@@ -240,26 +236,52 @@ void handle_usb_tablet_event (struct input_event *ev, int slot)
         check_and_inject_event (&new_ev, slot, HID_TYPE_TABLET);
 }
 
-int init_usb_tablet (int fd, int slot, uint8_t subtype)
+/* Set up a tablet from its axis ranges. Used directly when replaying a
+ * capture, where there is no device node to ask. */
+struct tablet_state *init_usb_tablet_ranges (const struct input_absinfo *absinfo_x,
+                                             const struct input_absinfo *absinfo_y,
+                                             uint8_t subtype)
 {
-    struct input_absinfo absinfo_x;
-    struct input_absinfo absinfo_y;
-
-    int ret = 0;
-    int i;
     int diff;
+    struct tablet_state* t = calloc(1, sizeof (*t));
 
-
-    struct input_id id;
-    struct tablet_scaling_params* t = &(tscale[slot]);
-    ignore_events[slot] = 0;
- 
+    if (!t)
+        return NULL;
     t->subtype = subtype;
     t->btnleft=0;
     t->tool=0;
 
+    t->x_offs = absinfo_x->minimum;
+    diff = absinfo_x->maximum - absinfo_x->minimum;
+
+    if (diff != 0)
+        t->x_mult = ((double) NEW_X_RESOLUTION) / ((double) diff);
+    else
+        goto fail;
+
+    t->y_offs = absinfo_y->minimum;
+    diff = absinfo_y->maximum - absinfo_y->minimum;
+
+    if (diff != 0)
+        t->y_mult = ((double) NEW_Y_RESOLUTION) / ((double) diff);
+    else
+        goto fail;
+
+    return t;
+
+fail:
+    free(t);
+    return NULL;
+}
+
+struct tablet_state *init_usb_tablet (int fd, uint8_t subtype)
+{
+    struct input_absinfo absinfo_x;
+    struct input_absinfo absinfo_y;
+    struct input_id id;
+
     if (ioctl (fd, EVIOCGID, &id) == -1)
-        return -1;
+        return NULL;
 
     if ((id.vendor==0x56a) && (id.product==0xed) && (subtype==SUBTYPE_MONOTOUCH)) // device lies
 	{
@@ -269,28 +291,12 @@ int init_usb_tablet (int fd, int slot, uint8_t subtype)
 	   absinfo_y.maximum=3620;
 	} else
 	{
-	    if ((ret = ioctl (fd, EVIOCGABS (ABS_X), &absinfo_x)) < 0)
-	        return ret;
+	    if (ioctl (fd, EVIOCGABS (ABS_X), &absinfo_x) < 0)
+	        return NULL;
 
-	    if ((ret = ioctl (fd, EVIOCGABS (ABS_Y), &absinfo_y)) < 0)
-        	return ret;
+	    if (ioctl (fd, EVIOCGABS (ABS_Y), &absinfo_y) < 0)
+        	return NULL;
 	}
 
-    t->x_offs = absinfo_x.minimum;
-    diff = absinfo_x.maximum - absinfo_x.minimum;
-
-    if (diff != 0)
-        t->x_mult = ((double) NEW_X_RESOLUTION) / ((double) diff);
-    else
-        return -1;
-
-    t->y_offs = absinfo_y.minimum;
-    diff = absinfo_y.maximum - absinfo_y.minimum;
-
-    if (diff != 0)
-        t->y_mult = ((double) NEW_Y_RESOLUTION) / ((double) diff);
-    else
-        return -1;
-
-    return 0;
+    return init_usb_tablet_ranges (&absinfo_x, &absinfo_y, subtype);
 }
@@ -148,6 +148,16 @@ message (int flags, const char *file, const char *function, int line,
     }
 }
 
+/* For measuring how long ago something happened, immune to clock changes. */
+void monotonic_time(struct timeval *tv)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    tv->tv_sec = ts.tv_sec;
+    tv->tv_usec = ts.tv_nsec / 1000;
+}
+
 void log_dbus_error (const char *file, const char *function, int line, const char *err, const char *fmt, ...)
 {
     char buf[128]={0};
@@ -19,6 +19,8 @@
 #ifndef _XC_INPUT_SOCKET_PROTOCOL_H_
 #define _XC_INPUT_SOCKET_PROTOCOL_H_
 
+#include <stdint.h>
+
 #define SWITCHER_SHUTDOWN_REBOOT 0
 #define SWITCHER_SHUTDOWN_S3 3
 #define SWITCHER_SHUTDOWN_S4 4
@@ -29,5 +31,85 @@ enum switcher_opt
     SWITCHER_OPT_PVM = 1
 };
 
+/*
+ * Shared memory transport for input plugins.
+ *
+ * A plugin asks for it with an EV_VM/VM_SHM record on the input socket.
+ * input_server answers with an EV_VM/VM_SHM record whose ivalue is the
+ * ring size, passing a memfd holding the ring and an eventfd as
+ * SCM_RIGHTS. From then on every record for the plugin is written to
+ * the ring, and the eventfd is bumped once per frame. The socket keeps
+ * carrying what the plugin sends.
+ *
+ * The ring is single producer (input_server moves head) and single
+ * consumer (the plugin moves tail). Both are free running counters;
+ * size is a power of two and records follow the header.
+ */
+#define INPUT_SHM_RING_LEN 1024
+
+struct input_shm_ring
+{
+    uint32_t size;              /* records in the ring */
+    uint32_t dropped;           /* records lost on a full ring */
+    volatile uint32_t head;     /* next record input_server writes */
+    volatile uint32_t tail;     /* next record the plugin reads */
+};
+
+/*
+ * Plugin wire protocol v2.
+ *
+ * v1 is a plain stream of event_records (magic, type, code, value). A
+ * plugin that wants more sends a v1 EV_VM/VM_HELLO record (7/5) whose
+ * ivalue is INPUT_PROTO_HELLO(version, caps). input_server answers with
+ * a VM_HELLO carrying the version it speaks and the caps it accepted;
+ * when that is v2 it is the last v1 record on the connection. Plugins
+ * that never say hello stay on v1.
+ *
+ * In v2 input_server only sends frames: an input_frame_header followed
+ * by count input_frame_events, len being the bytes after the header. A
+ * frame normally holds one SYN_REPORT worth of events; device and error
+ * records travel in frames too.
+ *
+ * With INPUT_PROTO_CAP_ACK the plugin acknowledges frames by sending
+ * EV_VM/VM_ACK (7/6) with the seq of the last frame it consumed. While
+ * INPUT_PROTO_ACK_WINDOW frames are outstanding, frames holding nothing
+ * but motion are dropped; key edges and device records still go.
+ *
+ * What the plugin sends stays v1 records, and frames are not used over
+ * the shared memory ring.
+ */
+#define INPUT_PROTO_V1 1
+#define INPUT_PROTO_V2 2
+
+#define INPUT_PROTO_CAP_TIMESTAMPS      (1 << 0)
+#define INPUT_PROTO_CAP_ACK             (1 << 1)
+
+#define INPUT_PROTO_HELLO(version, caps) (((version) << 16) | ((caps) & 0xffff))
+#define INPUT_PROTO_HELLO_VERSION(v)    ((v) >> 16)
+#define INPUT_PROTO_HELLO_CAPS(v)       ((v) & 0xffff)
+
+#define INPUT_PROTO_ACK_WINDOW 32
+
+#define INPUT_FRAME_MAGIC 0xAD9CBCEA
+#define INPUT_FRAME_MAX 64
+
+struct input_frame_header
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t count;
+    uint32_t seq;
+    uint32_t len;
+} __attribute__((__packed__));
+
+struct input_frame_event
+{
+    uint32_t sec;               /* kernel timestamp, zero without */
+    uint32_t usec;              /* INPUT_PROTO_CAP_TIMESTAMPS */
+    uint16_t type;
+    uint16_t code;
+    uint32_t value;
+} __attribute__((__packed__));
+
 #endif
 
@@ -18,28 +18,292 @@
 
 #include "project.h"
 
-static int
-xen_event_write_page(struct xen_vkbd_device *dev,
-                     union xenkbd_in_event *event)
+/* Above this many unconsumed entries, motion is merged instead of queued on
+ * the ring. The rest of the ring is kept for key events. */
+#define XEN_EVENT_RING_HIGH     (XENKBD_IN_RING_LEN * 3 / 4)
+
+/* How often to retry pushing the backlog while the frontend is stalled */
+#define XEN_EVENT_RETRY_MS      10
+
+static bool
+xen_event_is_motion(const union xenkbd_in_event *event)
+{
+    return event->type == XENKBD_TYPE_MOTION || event->type == XENKBD_TYPE_POS;
+}
+
+static uint32_t
+xen_event_ring_used(struct xenkbd_page *page)
+{
+    uint32_t cons = page->in_cons;
+
+    xen_mb();
+    return page->in_prod - cons;
+}
+
+/* An event has left once the frontend is told about it. */
+static void
+xen_event_latency(struct xen_vkbd_device *dev)
+{
+    unsigned int i;
+
+    for (i = 0; i < dev->sent_count; i++)
+        if (dev->sent[i].type >= 0)
+            latency_record(dev->sent[i].type, LATENCY_DEST_XENKBD, &dev->sent[i].time);
+    dev->sent_count = 0;
+}
+
+static void
+xen_event_ring_put(struct xen_vkbd_device *dev,
+                   union xenkbd_in_event *event,
+                   const struct xen_event_stamp *stamp)
 {
     uint32_t prod;
     struct xenkbd_page *page = dev->page;
 
-    if (!page)
-        return -1;
+    /* The frontend consumed a full ring without being kicked. */
+    if (dev->sent_count == ARRAY_LEN(dev->sent))
+        xen_event_latency(dev);
+    dev->sent[dev->sent_count++] = *stamp;
 
     prod = page->in_prod;
     xen_mb();
     XENKBD_IN_RING_REF(page, prod) = *event;
     xen_wmb();
     page->in_prod = prod + 1;
+    dev->notify_pending = true;
+}
+
+static int
+xen_event_notify(struct xen_vkbd_device *dev)
+{
+    if (!dev || !dev->page || !dev->notify_pending)
+        return 0;
 
+    dev->notify_pending = false;
+    xen_event_latency(dev);
     return backend_evtchn_notify(dev->backend, dev->devid);
 }
 
+static bool
+xen_event_ring_has_room(struct xen_vkbd_device *dev,
+                        union xenkbd_in_event *event)
+{
+    uint32_t used = xen_event_ring_used(dev->page);
+
+    if (xen_event_is_motion(event))
+        return used < XEN_EVENT_RING_HIGH;
+    return used < XENKBD_IN_RING_LEN;
+}
+
+static void
+xen_event_backlog_retry(int fd, short event, void *opaque);
+
+/* Move as much of the backlog as fits onto the ring, oldest first. */
+static void
+xen_event_drain(struct xen_vkbd_device *dev)
+{
+    struct timeval tv = { 0, XEN_EVENT_RETRY_MS * 1000 };
+
+    while (dev->backlog_count)
+    {
+        union xenkbd_in_event *event = &dev->backlog[dev->backlog_head];
+
+        if (!xen_event_ring_has_room(dev, event))
+            break;
+
+        xen_event_ring_put(dev, event, &dev->backlog_stamp[dev->backlog_head]);
+        dev->backlog_head = (dev->backlog_head + 1) % XEN_VKBD_BACKLOG_LEN;
+        dev->backlog_count--;
+    }
+
+    if (dev->backlog_count)
+    {
+        if (!evtimer_initialized(&dev->backlog_event))
+            evtimer_set(&dev->backlog_event, xen_event_backlog_retry, dev);
+        evtimer_add(&dev->backlog_event, &tv);
+    }
+    else if (evtimer_initialized(&dev->backlog_event))
+        evtimer_del(&dev->backlog_event);
+}
+
+static void
+xen_event_backlog_retry(int fd, short event, void *opaque)
+{
+    struct xen_vkbd_device *dev = opaque;
+
+    if (!dev->page)
+        return;
+
+    xen_event_drain(dev);
+    xen_event_notify(dev);
+}
+
+static union xenkbd_in_event *
+xen_event_backlog_at(struct xen_vkbd_device *dev, unsigned int i)
+{
+    return &dev->backlog[(dev->backlog_head + i) % XEN_VKBD_BACKLOG_LEN];
+}
+
+static struct xen_event_stamp *
+xen_event_backlog_stamp(struct xen_vkbd_device *dev, unsigned int i)
+{
+    return &dev->backlog_stamp[(dev->backlog_head + i) % XEN_VKBD_BACKLOG_LEN];
+}
+
+/* Merge motion into the newest backlog entry when it is the same kind, so
+ * it never overtakes a key event queued before it. The entry keeps its
+ * stamp, latency is that of the oldest motion in it. */
+static bool
+xen_event_merge(struct xen_vkbd_device *dev,
+                union xenkbd_in_event *event)
+{
+    union xenkbd_in_event *tail;
+
+    if (!dev->backlog_count || !xen_event_is_motion(event))
+        return false;
+
+    tail = xen_event_backlog_at(dev, dev->backlog_count - 1);
+    if (tail->type != event->type)
+        return false;
+
+    if (event->type == XENKBD_TYPE_MOTION)
+    {
+        tail->motion.rel_x += event->motion.rel_x;
+        tail->motion.rel_y += event->motion.rel_y;
+        tail->motion.rel_z += event->motion.rel_z;
+    }
+    else
+    {
+        tail->pos.abs_x = event->pos.abs_x;
+        tail->pos.abs_y = event->pos.abs_y;
+        tail->pos.rel_z += event->pos.rel_z;
+    }
+    dev->merged++;
+
+    return true;
+}
+
+/* Drop the oldest queued motion entry to make room for a key event. */
+static bool
+xen_event_backlog_drop_motion(struct xen_vkbd_device *dev)
+{
+    unsigned int i;
+
+    for (i = 0; i < dev->backlog_count; i++)
+        if (xen_event_is_motion(xen_event_backlog_at(dev, i)))
+            break;
+
+    if (i == dev->backlog_count)
+        return false;
+
+    for (; i + 1 < dev->backlog_count; i++)
+    {
+        *xen_event_backlog_at(dev, i) = *xen_event_backlog_at(dev, i + 1);
+        *xen_event_backlog_stamp(dev, i) = *xen_event_backlog_stamp(dev, i + 1);
+    }
+    dev->backlog_count--;
+
+    return true;
+}
+
+static int
+xen_event_backlog_add(struct xen_vkbd_device *dev,
+                      union xenkbd_in_event *event,
+                      const struct xen_event_stamp *stamp)
+{
+    if (xen_event_merge(dev, event))
+        return 0;
+
+    if (dev->backlog_count == XEN_VKBD_BACKLOG_LEN)
+    {
+        /* A key event displaces queued motion, new motion is just lost. */
+        if (xen_event_is_motion(event) || !xen_event_backlog_drop_motion(dev))
+        {
+            dev->dropped++;
+            /* Log at 1, 2, 4, 8... drops so a stuck guest doesn't flood syslog. */
+            if (!(dev->dropped & (dev->dropped - 1)))
+                warning("vkbd%d: frontend is not consuming events, %lu dropped",
+                        dev->devid, dev->dropped);
+            return -1;
+        }
+        dev->dropped++;
+    }
+
+    *xen_event_backlog_at(dev, dev->backlog_count) = *event;
+    *xen_event_backlog_stamp(dev, dev->backlog_count) = *stamp;
+    dev->backlog_count++;
+
+    return 0;
+}
+
+static int
+xen_event_write_page(struct xen_vkbd_device *dev,
+                     union xenkbd_in_event *event,
+                     const struct xen_event_stamp *stamp)
+{
+    if (!dev || !dev->page)
+        return -1;
+
+    xen_event_drain(dev);
+
+    if (!dev->backlog_count && xen_event_ring_has_room(dev, event))
+    {
+        xen_event_ring_put(dev, event, stamp);
+        return 0;
+    }
+
+    return xen_event_backlog_add(dev, event, stamp);
+}
+
+/* Kick the frontend once for everything written to the rings since the
+ * last flush, instead of once per ring entry. */
+void
+xen_event_flush(struct xen_vkbd_backend *backend)
+{
+    if (!backend)
+        return;
+
+    xen_event_notify(backend->device);
+    xen_event_notify(backend->abs_device);
+}
+
+/* Whether events are still waiting for room in the frontend's rings */
+bool
+xen_event_busy(struct xen_vkbd_backend *backend)
+{
+    if (!backend)
+        return false;
+
+    return (backend->device && backend->device->backlog_count) ||
+           (backend->abs_device && backend->abs_device->backlog_count);
+}
+
+void
+xen_event_stats(struct xen_vkbd_backend *backend,
+                unsigned long *merged, unsigned long *dropped)
+{
+    struct xen_vkbd_device *devs[2];
+    unsigned int i;
+
+    *merged = *dropped = 0;
+    if (!backend)
+        return;
+
+    devs[0] = backend->device;
+    devs[1] = backend->abs_device;
+    for (i = 0; i < ARRAY_LEN(devs); i++)
+    {
+        if (!devs[i])
+            continue;
+        *merged += devs[i]->merged;
+        *dropped += devs[i]->dropped;
+    }
+}
+
 /* Send a keyboard (or mouse button) event */
 static int
-xen_event_send_key(struct xen_vkbd_backend *backend, bool down, int keycode)
+xen_event_send_key(struct xen_vkbd_backend *backend, bool down, int keycode,
+                   const struct xen_event_stamp *stamp)
 {
     union xenkbd_in_event event;
 
@@ -50,14 +314,15 @@ xen_event_send_key(struct xen_vkbd_backend *backend, bool down, int keycode)
 
     if (keycode >= BTN_LEFT && keycode <= BTN_TASK)
         /* This is a mouse click, sending to the absolute device. */
-        return xen_event_write_page(backend->abs_device, &event);
+        return xen_event_write_page(backend->abs_device, &event, stamp);
     else
-        return xen_event_write_page(backend->device, &event);
+        return xen_event_write_page(backend->device, &event, stamp);
 }
 
 /* Send a relative mouse movement */
 static int
-xen_event_send_motion(struct xen_vkbd_backend *backend, int rel_x, int rel_y, int rel_z)
+xen_event_send_motion(struct xen_vkbd_backend *backend, int rel_x, int rel_y, int rel_z,
+                      const struct xen_event_stamp *stamp)
 {
     union xenkbd_in_event event;
 
@@ -67,12 +332,13 @@ xen_event_send_motion(struct xen_vkbd_backend *backend, int rel_x, int rel_y, in
     event.motion.rel_y = rel_y;
     event.motion.rel_z = rel_z;
 
-    return xen_event_write_page(backend->device, &event);
+    return xen_event_write_page(backend->device, &event, stamp);
 }
 
 /* Send an absolute mouse movement */
 static int
-xen_event_send_position(struct xen_vkbd_backend *backend, int abs_x, int abs_y, int z)
+xen_event_send_position(struct xen_vkbd_backend *backend, int abs_x, int abs_y, int z,
+                        const struct xen_event_stamp *stamp)
 {
     union xenkbd_in_event event;
 
@@ -82,24 +348,29 @@ xen_event_send_position(struct xen_vkbd_backend *backend, int abs_x, int abs_y,
     event.pos.abs_y = abs_y;
     event.pos.rel_z = z;
 
-    return xen_event_write_page(backend->abs_device, &event);
+    return xen_event_write_page(backend->abs_device, &event, stamp);
 }
 
 void
 xen_event_send(struct xen_vkbd_backend *backend,
                uint16_t type,
                uint16_t code,
-               int32_t value)
+               int32_t value,
+               const struct xen_event_stamp *stamp)
 {
     static int absolute_x=0, absolute_y=0, absolute_z=0, absolute=0;
     static int relative_x=0, relative_y=0, relative_z=0, relative=0;
+    /* Motion is stamped with the first event of the frame */
+    static struct xen_event_stamp absolute_stamp, relative_stamp;
 
     if (type == EV_KEY)
-        xen_event_send_key(backend, value, code);
+        xen_event_send_key(backend, value, code, stamp);
 
     /* Mouse motion */
     if (type == EV_REL)
     {
+        if (!relative)
+            relative_stamp = *stamp;
         switch (code)
         {
             case REL_X:
@@ -117,6 +388,8 @@ xen_event_send(struct xen_vkbd_backend *backend,
 
     if (type == EV_ABS)
     {
+        if (!absolute)
+            absolute_stamp = *stamp;
         switch (code)
         {
             case ABS_X:
@@ -136,14 +409,17 @@ xen_event_send(struct xen_vkbd_backend *backend,
     {
         if (relative)
         {
-            xen_event_send_motion(backend, relative_x, relative_y, relative_z);
+            xen_event_send_motion(backend, relative_x, relative_y, relative_z,
+                                  &relative_stamp);
             relative = relative_x = relative_y = relative_z = 0;
         }
         if (absolute)
         {
-            xen_event_send_position(backend, absolute_x, absolute_y, absolute_z);
+            xen_event_send_position(backend, absolute_x, absolute_y, absolute_z,
+                                    &absolute_stamp);
             absolute = absolute_z = 0;
         }
+        xen_event_flush(backend);
     }
 }
 
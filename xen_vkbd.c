@@ -55,12 +55,16 @@ xen_vkbd_handle_led(struct input_event *event,
     input_led_code(d->keyboard_led_code, d->domid);
 }
 
+/* type is the kind of device the event came from, -1 if not known */
 void
 xen_vkbd_send_event(struct domain *d,
-                    struct input_event *event)
+                    struct input_event *event,
+                    int type)
 {
+    struct xen_event_stamp stamp = { event->time, type };
+
     xen_vkbd_handle_led(event, d);
-    xen_event_send(d->vkbd_backend, event->type, event->code, event->value);
+    xen_event_send(d->vkbd_backend, event->type, event->code, event->value, &stamp);
 }
 
 /* Backend device operations */
@@ -76,17 +80,37 @@ xen_vkbd_alloc(xen_backend_t backend, int devid, void *priv)
 
     dev->devid = devid;
     dev->backend = backend;
+    dev->back = back;
 
-    if (devid == 0) /* keyboard and relative mouse events device */
-        back->device = dev;
-    else if (devid == 1) /* absolute mouse events device */
-        back->abs_device = dev;
-    else
+    if (devid != 0 && devid != 1)
         warning("Unknown vkbd device id #%d\n", devid);
 
     return dev;
 }
 
+/* Publish or withdraw a device in its vkbd backend.  Input paths only ever
+ * reach a device through these pointers, so they must not outlive it. */
+static void
+xen_vkbd_attach(struct xen_vkbd_device *dev, bool attach)
+{
+    struct xen_vkbd_backend *back = dev->back;
+
+    if (dev->devid == 0) /* keyboard and relative mouse events device */
+    {
+        if (attach)
+            back->device = dev;
+        else if (back->device == dev)
+            back->device = NULL;
+    }
+    else if (dev->devid == 1) /* absolute mouse events device */
+    {
+        if (attach)
+            back->abs_device = dev;
+        else if (back->abs_device == dev)
+            back->abs_device = NULL;
+    }
+}
+
 static int
 xen_vkbd_init(xen_device_t xendev)
 {
@@ -124,6 +148,8 @@ xen_vkbd_connect(xen_device_t xendev)
     if (!dev->page)
         return -1;
 
+    xen_vkbd_attach(dev, true);
+
     return 0;
 }
 
@@ -133,9 +159,16 @@ xen_vkbd_disconnect(xen_device_t xendev)
 {
     struct xen_vkbd_device *dev = xendev;
 
+    xen_vkbd_attach(dev, false);
+    dev->notify_pending = false;
+
     event_del(&dev->evtchn_event);
     backend_unbind_evtchn(dev->backend, dev->devid);
 
+    if (evtimer_initialized(&dev->backlog_event))
+        evtimer_del(&dev->backlog_event);
+    dev->backlog_count = 0;
+
     if (dev->page)
     {
         backend_unmap_shared_page(dev->backend, dev->devid, dev->page);
@@ -151,8 +184,6 @@ xen_vkbd_free(xen_device_t xendev)
 
     xen_vkbd_disconnect(dev);
 
-    // FIXME : Tell xen_vkbd_backend we are gone ?
-
     free(dev);
 }
 
@@ -175,7 +206,12 @@ xen_vkbd_backend_create(struct domain *d)
 {
     struct xen_vkbd_backend *backend;
 
-    backend = malloc(sizeof (*backend));
+    backend = calloc(1, sizeof (*backend));
+    if (!backend)
+    {
+        error("%s: failed to allocate VKBD backend for dom%u!", __func__, d->domid);
+        return;
+    }
 
     backend->domid = d->domid;
 
@@ -24,13 +24,41 @@
 #include <xenbackend.h>
 #include <fb2if.h>
 
+/* Events held back while the frontend is not consuming the in-ring */
+#define XEN_VKBD_BACKLOG_LEN 64
+
 /* Structures definitions */
+struct xen_vkbd_backend;
+
+/* When the input behind a ring entry arrived and the type of device it
+ * came from (-1 if not known), for latency accounting */
+struct xen_event_stamp
+{
+    struct timeval time;
+    int type;
+};
+
 struct xen_vkbd_device
 {
     xen_backend_t backend;
+    struct xen_vkbd_backend *back;
     int devid;
     void *page;
     struct event evtchn_event;
+    /* Ring entries were produced since the last event channel notify */
+    bool notify_pending;
+    /* Stamps of those entries, recorded once the frontend is kicked */
+    struct xen_event_stamp sent[XENKBD_IN_RING_LEN];
+    unsigned int sent_count;
+
+    union xenkbd_in_event backlog[XEN_VKBD_BACKLOG_LEN];
+    struct xen_event_stamp backlog_stamp[XEN_VKBD_BACKLOG_LEN];
+    unsigned int backlog_head;
+    unsigned int backlog_count;
+    struct event backlog_event;
+
+    unsigned long merged;
+    unsigned long dropped;
 };
 
 struct xen_vkbd_backend